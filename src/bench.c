@@ -0,0 +1,336 @@
+/* Copyright (C) 2014-2023 Doug Torrance <dtorrance@piedmont.edu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* microbenchmarks for the display-independent parts of wmforecast, run
+ * with "make bench" */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "wmforecast.h"
+
+#define MIN_BENCH_TIME 200000000LL /* nanoseconds */
+#define HOUR 3600
+
+typedef struct {
+	int length;
+	ForecastSample *samples;
+	ProviderResult *result;
+	Arena *arena;
+	Weather *weather;
+	char *attribution;
+} BenchData;
+
+typedef struct {
+	const char *name;
+	void (*run)(BenchData *data);
+} Benchmark;
+
+static const int default_lengths[] = {48, 168, 1000, 10000};
+
+static const char *sample_conditions[] = {
+	"Clear sky",
+	"Partly cloudy",
+	"Overcast",
+	"Light rain",
+	"Snow"
+};
+
+#define NUM_CONDITIONS \
+	(sizeof(sample_conditions) / sizeof(sample_conditions[0]))
+
+#ifdef __GLIBC__
+/* count every allocation made through malloc, which is what wmalloc and
+ * g_malloc end up calling */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long allocations;
+
+void *malloc(size_t size)
+{
+	allocations++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	allocations++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	allocations++;
+	return __libc_realloc(ptr, size);
+}
+#define HAVE_ALLOCATION_COUNT 1
+#else
+static unsigned long allocations;
+#endif
+
+/* how far apart samples are: hourly, unless that would run past the
+ * MAX_FORECASTS days that can be bucketed, in which case they are packed
+ * closer together so that the whole list still is */
+static time_t getSampleStep(int length)
+{
+	time_t span = (time_t)(MAX_FORECASTS - 1) * SECONDS_PER_DAY;
+
+	if ((time_t)length * HOUR <= span)
+		return HOUR;
+	return span / length ? span / length : 1;
+}
+
+static long long now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* samples starting at the top of the current hour, getSampleStep()
+ * apart, with a daily temperature swing */
+static ForecastSample *makeSamples(int length)
+{
+	ForecastSample *samples;
+	time_t start, step;
+	int i;
+
+	samples = wmalloc(length * sizeof(ForecastSample));
+	start = time(NULL) / HOUR * HOUR;
+	step = getSampleStep(length);
+
+	for (i = 0; i < length; i++) {
+		long int hours = (long int)i * step / HOUR;
+		int hour = hours % 24;
+
+		samples[i].time = start + (time_t)i * step;
+		samples[i].temp = 60 + 15 * (hour < 12 ? hour : 24 - hour) /
+			12.0;
+		samples[i].haveTemp = True;
+		samples[i].conditions =
+			sample_conditions[(hours / 24) % NUM_CONDITIONS];
+		samples[i].summary = samples[i].conditions;
+		samples[i].code = "weather-clear";
+	}
+
+	return samples;
+}
+
+/* one linked provider per couple of days' worth of samples */
+static char *makeAttribution(int length)
+{
+	TextBuilder builder;
+	int i;
+
+	initTextBuilder(&builder, 64);
+	for (i = 0; i <= length / 48; i++)
+		appendTextf(&builder,
+			    "Data by <a href=\"https://example.org/%d\">"
+			    "Provider %d</a>. ", i, i);
+
+	return finishText(&builder);
+}
+
+static void benchGatherForecasts(BenchData *data)
+{
+	Weather *weather;
+
+	resetArena(data->arena);
+	weather = newWeather(data->arena);
+	gather_forecasts(weather, data->samples, data->length,
+			 MAX_FORECASTS);
+}
+
+/* everything a refresh does between the provider and the screen */
+static void benchBuildWeather(BenchData *data)
+{
+	resetArena(data->arena);
+	buildWeather(data->result, MAX_FORECASTS, data->arena);
+}
+
+/* forecasts are stored inline, so this fills one whole forecast whatever
+ * the length */
+static void benchAppendForecast(BenchData *data)
+{
+	ForecastArray array;
+	int i;
+
+	(void)data;
+	array.length = 0;
+	for (i = 0; i < MAX_FORECASTS; i++)
+		setForecast(appendForecast(&array), i % 7, 10, 21,
+			    "Clear sky");
+}
+
+static void benchForecastText(BenchData *data)
+{
+	wfree(getForecastText(data->weather,
+			      data->weather->forecasts.length,
+			      GWEATHER_TEMP_UNIT_FAHRENHEIT));
+}
+
+static void benchStripTags(BenchData *data)
+{
+	wfree(strip_tags(data->attribution));
+}
+
+static void benchCheckIcondir(BenchData *data)
+{
+	(void)data;
+	check_icondir(DATADIR);
+}
+
+static const Benchmark benchmarks[] = {
+	{"gather_forecasts", benchGatherForecasts},
+	{"buildWeather", benchBuildWeather},
+	{"appendForecast", benchAppendForecast},
+	{"getForecastText", benchForecastText},
+	{"strip_tags", benchStripTags},
+	{"check_icondir", benchCheckIcondir}
+};
+
+static const Benchmark replayBenchmark = {"buildWeather", benchBuildWeather};
+
+/* double the iterations until a run takes long enough to be measured */
+static void runBenchmark(const Benchmark *benchmark, BenchData *data)
+{
+	long long iterations, i, start, elapsed;
+	unsigned long before;
+
+	for (iterations = 1; ; iterations *= 2) {
+		before = allocations;
+		start = now();
+		for (i = 0; i < iterations; i++)
+			benchmark->run(data);
+		elapsed = now() - start;
+		if (elapsed >= MIN_BENCH_TIME)
+			break;
+	}
+
+	printf("%-16s %8d %14.1f", benchmark->name, data->length,
+	       (double)elapsed / iterations);
+#ifdef HAVE_ALLOCATION_COUNT
+	printf(" %12.2f\n", (double)(allocations - before) / iterations);
+#else
+	(void)before;
+	printf(" %12s\n", "-");
+#endif
+}
+
+static ProviderResult *makeResult(ForecastSample *samples, int length,
+				  const char *attribution, Arena *arena)
+{
+	ProviderResult *result;
+
+	result = arenaAlloc(arena, sizeof(ProviderResult));
+	result->valid = True;
+	result->units = GWEATHER_TEMP_UNIT_FAHRENHEIT;
+	result->attribution = attribution;
+	result->current = samples[0];
+	result->details = "";
+	result->length = length;
+	result->samples = samples;
+	return result;
+}
+
+/* with a recording, only the end-to-end build is timed, since that's the
+ * only thing it has real data for */
+static void runBenchmarks(int length, ProviderResult *recorded)
+{
+	BenchData data;
+	Arena *weatherArena, *resultArena;
+	size_t i;
+
+	resultArena = newArena();
+	data.arena = newArena();
+	if (recorded) {
+		data.length = recorded->length;
+		data.samples = NULL;
+		data.attribution = NULL;
+		data.result = recorded;
+		runBenchmark(&replayBenchmark, &data);
+		freeArena(data.arena);
+		freeArena(resultArena);
+		return;
+	}
+
+	data.length = length;
+	data.samples = makeSamples(length);
+	data.attribution = makeAttribution(length);
+	data.result = makeResult(data.samples, length, data.attribution,
+				 resultArena);
+
+	weatherArena = newArena();
+	data.weather = newWeather(weatherArena);
+	gather_forecasts(data.weather, data.samples, length, MAX_FORECASTS);
+
+	for (i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++)
+		runBenchmark(&benchmarks[i], &data);
+
+	freeArena(weatherArena);
+	freeArena(resultArena);
+	freeArena(data.arena);
+	wfree(data.attribution);
+	wfree(data.samples);
+}
+
+int main(int argc, char **argv)
+{
+	int i;
+
+	printf("%-16s %8s %14s %12s\n", "benchmark", "length", "ns/op",
+	       "allocs/op");
+
+	/* each argument is either a forecast length or a file saved with
+	 * wmforecast --record */
+	if (argc > 1) {
+		Arena *arena = newArena();
+
+		for (i = 1; i < argc; i++) {
+			ProviderResult *recorded;
+			int length = atoi(argv[i]);
+
+			if (length > 0) {
+				runBenchmarks(length, NULL);
+				continue;
+			}
+
+			recorded = loadProviderResult(argv[i], arena);
+			if (!recorded) {
+				fprintf(stderr, "invalid length or recording: "
+					"%s\n", argv[i]);
+				freeArena(arena);
+				return EXIT_FAILURE;
+			}
+			runBenchmarks(0, recorded);
+		}
+		freeArena(arena);
+	} else {
+		for (i = 0; i < (int)(sizeof(default_lengths) /
+				      sizeof(default_lengths[0])); i++)
+			runBenchmarks(default_lengths[i], NULL);
+	}
+
+	return EXIT_SUCCESS;
+}
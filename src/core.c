@@ -0,0 +1,1107 @@
+/* Copyright (C) 2014-2023 Doug Torrance <dtorrance@piedmont.edu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <limits.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wmforecast.h"
+
+static const char *phase_names[NUM_PHASES] = {
+	"location",
+	"provider",
+	"read",
+	"build",
+	"icon",
+	"draw",
+	"total"
+};
+
+RefreshStats refreshStats;
+
+const char *icon_names[NUM_ICONS] = {
+	"dialog-error",
+	"weather-clear-night",
+	"weather-clear",
+	"weather-few-clouds-night",
+	"weather-few-clouds",
+	"weather-fog",
+	"weather-overcast",
+	"weather-showers",
+	"weather-snow",
+	"weather-storm"
+};
+
+Arena *newArena(void)
+{
+	Arena *arena = wmalloc(sizeof(Arena));
+	arena->chunks = NULL;
+	arena->current = NULL;
+	return arena;
+}
+
+void *arenaAlloc(Arena *arena, size_t size)
+{
+	ArenaChunk *chunk;
+	void *ptr;
+
+	size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+
+	/* after a reset, reuse the chunks we already have before asking for
+	 * more memory */
+	for (chunk = arena->current; chunk; chunk = chunk->next) {
+		if (chunk->size - chunk->used >= size)
+			break;
+	}
+
+	if (!chunk) {
+		ArenaChunk *last;
+		size_t chunkSize;
+
+		chunkSize = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+		chunk = wmalloc(sizeof(ArenaChunk) + chunkSize);
+		chunk->next = NULL;
+		chunk->size = chunkSize;
+		chunk->used = 0;
+
+		if (!arena->chunks)
+			arena->chunks = chunk;
+		else {
+			for (last = arena->chunks; last->next;
+			     last = last->next)
+				;
+			last->next = chunk;
+		}
+	}
+
+	arena->current = chunk;
+	ptr = chunk->data + chunk->used;
+	chunk->used += size;
+	return ptr;
+}
+
+char *arenaStrdup(Arena *arena, const char *str)
+{
+	char *copy;
+	size_t length;
+
+	if (!str)
+		return NULL;
+
+	length = strlen(str) + 1;
+	copy = arenaAlloc(arena, length);
+	memcpy(copy, str, length);
+	return copy;
+}
+
+/* everything allocated from the arena is released at once, but the
+ * memory is kept for the next round of allocations */
+void resetArena(Arena *arena)
+{
+	ArenaChunk *chunk;
+
+	for (chunk = arena->chunks; chunk; chunk = chunk->next)
+		chunk->used = 0;
+	arena->current = arena->chunks;
+}
+
+/* give every chunk and the arena itself back */
+void freeArena(Arena *arena)
+{
+	ArenaChunk *chunk, *next;
+
+	for (chunk = arena->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		wfree(chunk);
+	}
+	wfree(arena);
+}
+
+/* condition and icon names come from a small set, so each one is stored
+ * once for the life of the process instead of once per forecast */
+static const char **internedStrings;
+static int internedLength;
+static int internedCapacity;
+
+static unsigned long hashString(const char *text)
+{
+	unsigned long hash = 5381;
+
+	while (*text)
+		hash = hash * 33 + (unsigned char)*text++;
+	return hash;
+}
+
+static void growInternedStrings(void)
+{
+	const char **old = internedStrings;
+	int i, oldCapacity = internedCapacity;
+
+	internedCapacity = internedCapacity ? 2 * internedCapacity : 64;
+	internedStrings = wmalloc(internedCapacity * sizeof(char *));
+	memset(internedStrings, 0, internedCapacity * sizeof(char *));
+	for (i = 0; i < oldCapacity; i++) {
+		unsigned long j;
+
+		if (!old[i])
+			continue;
+		j = hashString(old[i]) & (internedCapacity - 1);
+		while (internedStrings[j])
+			j = (j + 1) & (internedCapacity - 1);
+		internedStrings[j] = old[i];
+	}
+	wfree(old);
+}
+
+/* returns the one copy of text, which is never freed */
+const char *internString(const char *text)
+{
+	unsigned long i;
+
+	if (!text)
+		return NULL;
+
+	/* keep the table at most half full */
+	if (2 * (internedLength + 1) > internedCapacity)
+		growInternedStrings();
+
+	i = hashString(text) & (internedCapacity - 1);
+	while (internedStrings[i]) {
+		if (strcmp(internedStrings[i], text) == 0)
+			return internedStrings[i];
+		i = (i + 1) & (internedCapacity - 1);
+	}
+
+	internedStrings[i] = wstrdup(text);
+	internedLength++;
+	return internedStrings[i];
+}
+
+/* the abbreviated name of a day of the week in the current locale */
+const char *getWeekdayName(int weekday)
+{
+	static char names[7][32];
+
+	if (!names[weekday][0]) {
+		struct tm tm;
+
+		memset(&tm, 0, sizeof(tm));
+		tm.tm_wday = weekday;
+		strftime(names[weekday], sizeof(names[weekday]), "%a", &tm);
+	}
+
+	return names[weekday];
+}
+
+/* returns a new, empty forecast at the end of the array, or NULL if it
+ * is full */
+Forecast *appendForecast(ForecastArray *array)
+{
+	Forecast *forecast;
+
+	if (array->length == MAX_FORECASTS)
+		return NULL;
+
+	forecast = &array->forecasts[array->length++];
+	forecast->weekday = 0;
+	forecast->low = 0;
+	forecast->high = 0;
+	forecast->text = NULL;
+	return forecast;
+}
+
+/* the weather and everything it refers to live in the given arena */
+Weather *newWeather(Arena *arena)
+{
+	Weather *weather = arenaAlloc(arena, sizeof(Weather));
+	weather->arena = arena;
+	weather->temp = 0;
+	weather->text = NULL;
+	weather->code = NULL;
+	weather->conditions = NULL;
+	weather->forecasts.length = 0;
+	weather->errorFlag = 0;
+	weather->errorText = NULL;
+	weather->attribution = NULL;
+	return weather;
+}
+
+void freeWeather(Weather *weather)
+{
+	resetArena(weather->arena);
+}
+
+void setError(Weather *weather, const char *errorText)
+{
+	weather->errorFlag = 1;
+	weather->errorText = arenaStrdup(
+		weather->arena, errorText ? errorText : "An error occurred");
+}
+
+void setConditions(Weather *weather,
+		   double temp,
+		   const char *text,
+		   const char *code
+	)
+{
+	time_t currentTime;
+
+	weather->temp = temp;
+	weather->text = internString(text);
+	weather->code = internString(code);
+
+	currentTime = time(NULL);
+	weather->timestamp = currentTime;
+	strftime(weather->retrieved, sizeof weather->retrieved, "%l:%M %p %Z",
+		 localtime(&currentTime));
+}
+
+void setForecast(Forecast *forecast,
+		 int weekday,
+		 double low,
+		 double high,
+		 const char *text
+	)
+{
+	forecast->weekday = weekday;
+	forecast->low = low;
+	forecast->high = high;
+	forecast->text = internString(text);
+}
+
+/* a canonical temperature as shown in the given units */
+int displayTemp(double temp, GWeatherTemperatureUnit units)
+{
+	return lround(convertTemp(temp, CANONICAL_UNITS, units));
+}
+
+void initTextBuilder(TextBuilder *builder, size_t capacity)
+{
+	builder->length = 0;
+	builder->capacity = capacity ? capacity : 1;
+	builder->text = wmalloc(builder->capacity);
+	builder->text[0] = '\0';
+}
+
+/* make room for length more bytes plus the terminating null, at least
+ * doubling the buffer so a run of appends stays linear */
+void reserveText(TextBuilder *builder, size_t length)
+{
+	size_t needed;
+
+	needed = builder->length + length + 1;
+	if (needed <= builder->capacity)
+		return;
+
+	if (needed < 2 * builder->capacity)
+		needed = 2 * builder->capacity;
+	builder->text = wrealloc(builder->text, needed);
+	builder->capacity = needed;
+}
+
+void appendText(TextBuilder *builder, const char *text)
+{
+	if (text)
+		appendTextLength(builder, text, strlen(text));
+}
+
+/* text doesn't need to be null terminated */
+void appendTextLength(TextBuilder *builder, const char *text, size_t length)
+{
+	reserveText(builder, length);
+	memcpy(builder->text + builder->length, text, length);
+	builder->length += length;
+	builder->text[builder->length] = '\0';
+}
+
+void appendTextf(TextBuilder *builder, const char *format, ...)
+{
+	va_list args;
+	int length;
+
+	va_start(args, format);
+	length = vsnprintf(builder->text + builder->length,
+			   builder->capacity - builder->length, format, args);
+	va_end(args);
+	if (length < 0)
+		return;
+
+	if (builder->length + length >= builder->capacity) {
+		reserveText(builder, length);
+		va_start(args, format);
+		vsnprintf(builder->text + builder->length,
+			  builder->capacity - builder->length, format, args);
+		va_end(args);
+	}
+	builder->length += length;
+}
+
+/* hands the text over to the caller */
+char *finishText(TextBuilder *builder)
+{
+	char *text = builder->text;
+
+	builder->text = NULL;
+	builder->length = 0;
+	builder->capacity = 0;
+	return text;
+}
+
+static size_t safeLength(const char *text)
+{
+	return text ? strlen(text) : 0;
+}
+
+char *getForecastText(Weather *weather, int days,
+		      GWeatherTemperatureUnit units)
+{
+	TextBuilder builder;
+	size_t length;
+	int i;
+
+	/* size the buffer up front so it only needs one allocation */
+	length = sizeof("\n"PACKAGE_STRING"\n\nRetrieved: "
+			"\n\nCurrent Conditions:\n, °\n\nForecast"
+			" not available.\n\n\n") + 11 +
+		safeLength(weather->retrieved) + safeLength(weather->text) +
+		safeLength(weather->attribution);
+	for (i = 0; i < weather->forecasts.length && i < days; i++) {
+		Forecast *forecast = &weather->forecasts.forecasts[i];
+
+		length += sizeof(" - . High: ° Low: °\n") + 2 * 11 +
+			safeLength(getWeekdayName(forecast->weekday)) +
+			safeLength(forecast->text);
+	}
+	initTextBuilder(&builder, length);
+
+	appendText(&builder, "\n"PACKAGE_STRING"\n\nRetrieved: ");
+	appendText(&builder, weather->retrieved);
+	appendText(&builder, "\n\nCurrent Conditions:\n");
+	appendText(&builder, weather->text);
+	appendTextf(&builder, ", %d°\n\nForecast",
+		    displayTemp(weather->temp, units));
+
+	if (weather->forecasts.length == 0)
+		appendText(&builder, " not available.");
+	else {
+		appendText(&builder, ":\n");
+		for (i = 0; i < weather->forecasts.length && i < days; i++) {
+			Forecast *forecast = &weather->forecasts.forecasts[i];
+
+			appendText(&builder,
+				   getWeekdayName(forecast->weekday));
+			appendText(&builder, " - ");
+			appendText(&builder, forecast->text);
+			appendTextf(&builder, ". High: %d° Low: %d°\n",
+				    displayTemp(forecast->high, units),
+				    displayTemp(forecast->low, units));
+		}
+	}
+
+	appendText(&builder, "\n");
+	appendText(&builder, weather->attribution);
+	appendText(&builder, "\n\n");
+	return finishText(&builder);
+}
+
+char *getConditionsText(GWeatherInfo *info)
+{
+	TextBuilder builder;
+	char *fields[13];
+	size_t length;
+	int i;
+
+	fields[0] = gweather_info_get_location_name(info);
+	fields[1] = gweather_info_get_update(info);
+	fields[2] = gweather_info_get_conditions(info);
+	fields[3] = gweather_info_get_sky(info);
+	fields[4] = gweather_info_get_temp(info);
+	fields[5] = gweather_info_get_apparent(info);
+	fields[6] = gweather_info_get_dew(info);
+	fields[7] = gweather_info_get_humidity(info);
+	fields[8] = gweather_info_get_wind(info);
+	fields[9] = gweather_info_get_pressure(info);
+	fields[10] = gweather_info_get_visibility(info);
+	fields[11] = gweather_info_get_sunrise(info);
+	fields[12] = gweather_info_get_sunset(info);
+
+	length = 256;
+	for (i = 0; i < 13; i++)
+		length += safeLength(fields[i]);
+	initTextBuilder(&builder, length);
+
+	appendTextf(&builder, "\n"
+		    "City:\t\t\t\t%s\n"
+		    "Last update:\t\t%s\n"
+		    "Conditions:\t\t%s\n"
+		    "Sky:\t\t\t\t%s\n"
+		    "Temperature:\t\t%s\n"
+		    "Feels like:\t\t\t%s\n"
+		    "Dew point:\t\t%s\n"
+		    "Relative humidity:\t%s\n"
+		    "Wind:\t\t\t%s\n"
+		    "Pressure:\t\t\t%s\n"
+		    "Visibility:\t\t\t%s\n"
+		    "Sunrise:\t\t\t%s\n"
+		    "Sunset:\t\t\t%s\n\n",
+		    fields[0], fields[1], fields[2], fields[3], fields[4],
+		    fields[5], fields[6], fields[7], fields[8], fields[9],
+		    fields[10], fields[11], fields[12]);
+
+	for (i = 0; i < 13; i++)
+		g_free(fields[i]);
+
+	return finishText(&builder);
+}
+
+/* the icon names libgweather uses that aren't in icon_names */
+static const struct {
+	const char *name;
+	IconSlot slot;
+} icon_aliases[] = {
+	{"weather-showers-scattered", ICON_SHOWERS},
+	{"weather-severe-alert", ICON_STORM},
+	{"weather-tornado", ICON_STORM},
+	{"weather-hurricane", ICON_STORM},
+	{"weather-windy", ICON_FEW_CLOUDS},
+	{"weather-snow-scattered", ICON_SNOW},
+	{"weather-freezing-rain", ICON_SHOWERS},
+	{"weather-hail", ICON_SHOWERS}
+};
+
+typedef struct {
+	const char *name;
+	IconSlot slot;
+} IconEntry;
+
+/* icon names to slots, seeded from icon_names and icon_aliases and
+ * remembering every other name once its fallback has been worked out */
+static IconEntry *iconTable;
+static int iconTableLength;
+static int iconTableCapacity;
+
+static unsigned long hashIconName(const char *name, size_t length)
+{
+	unsigned long hash = 5381;
+
+	while (length--)
+		hash = hash * 33 + (unsigned char)*name++;
+	return hash;
+}
+
+static IconEntry *findIconEntry(const char *name, size_t length)
+{
+	unsigned long i;
+
+	i = hashIconName(name, length) & (iconTableCapacity - 1);
+	while (iconTable[i].name) {
+		if (strncmp(iconTable[i].name, name, length) == 0 &&
+		    !iconTable[i].name[length])
+			break;
+		i = (i + 1) & (iconTableCapacity - 1);
+	}
+	return &iconTable[i];
+}
+
+static void addIconEntry(const char *name, IconSlot slot)
+{
+	IconEntry *entry;
+
+	/* keep the table at most half full */
+	if (2 * (iconTableLength + 1) > iconTableCapacity) {
+		IconEntry *old = iconTable;
+		int i, oldCapacity = iconTableCapacity;
+
+		iconTableCapacity = oldCapacity ? 2 * oldCapacity : 64;
+		iconTable = wmalloc(iconTableCapacity * sizeof(IconEntry));
+		memset(iconTable, 0, iconTableCapacity * sizeof(IconEntry));
+		for (i = 0; i < oldCapacity; i++)
+			if (old[i].name)
+				*findIconEntry(old[i].name,
+					       strlen(old[i].name)) = old[i];
+		wfree(old);
+	}
+
+	entry = findIconEntry(name, strlen(name));
+	if (!entry->name)
+		iconTableLength++;
+	entry->name = name;
+	entry->slot = slot;
+}
+
+static void initIconTable(void)
+{
+	int i;
+
+	for (i = 0; i < NUM_ICONS; i++)
+		addIconEntry(icon_names[i], i);
+	for (i = 0; i < (int)(sizeof(icon_aliases) / sizeof(icon_aliases[0]));
+	     i++)
+		addIconEntry(icon_aliases[i].name, icon_aliases[i].slot);
+}
+
+static Bool hasSuffix(const char *name, size_t length, const char *suffix)
+{
+	size_t suffixLength = strlen(suffix);
+
+	return length > suffixLength &&
+		strncmp(name + length - suffixLength, suffix,
+			suffixLength) == 0;
+}
+
+/* the fallbacks are: a -symbolic or -large variant is the plain icon, a
+ * night icon the theme doesn't have is the day one, and anything else is
+ * overcast */
+static IconSlot resolveIconSlot(const char *name, size_t length)
+{
+	IconEntry *entry;
+
+	entry = findIconEntry(name, length);
+	if (entry->name)
+		return entry->slot;
+
+	if (hasSuffix(name, length, "-symbolic"))
+		return resolveIconSlot(name, length - strlen("-symbolic"));
+	if (hasSuffix(name, length, "-large"))
+		return resolveIconSlot(name, length - strlen("-large"));
+	if (hasSuffix(name, length, "-night"))
+		return resolveIconSlot(name, length - strlen("-night"));
+
+	return ICON_OVERCAST;
+}
+
+/* the slot for an icon name, in constant time once the name has been seen
+ * before */
+IconSlot getIconSlot(const char *code)
+{
+	IconEntry *entry;
+	IconSlot slot;
+
+	if (!code)
+		return ICON_OVERCAST;
+
+	if (!iconTable)
+		initIconTable();
+
+	entry = findIconEntry(code, strlen(code));
+	if (entry->name)
+		return entry->slot;
+
+	slot = resolveIconSlot(code, strlen(code));
+	addIconEntry(internString(code), slot);
+	return slot;
+}
+
+HourlySeries *newHourlySeries(int capacity)
+{
+	HourlySeries *series = wmalloc(sizeof(HourlySeries));
+
+	series->capacity = capacity;
+	series->length = 0;
+	series->times = wmalloc(capacity * sizeof(time_t));
+	series->temps = wmalloc(capacity * sizeof(float));
+	series->icons = wmalloc(capacity * sizeof(unsigned char));
+	return series;
+}
+
+void clearHourlySeries(HourlySeries *series)
+{
+	series->length = 0;
+}
+
+/* entries past the capacity are dropped */
+void appendHourly(HourlySeries *series, time_t time, float temp,
+		  unsigned char icon)
+{
+	if (series->length == series->capacity)
+		return;
+
+	series->times[series->length] = time;
+	series->temps[series->length] = temp;
+	series->icons[series->length] = icon;
+	series->length++;
+}
+
+/* average the temperatures into columns of the given number of seconds,
+ * the first one beginning at start; columns without data are NAN */
+void getHourlyColumns(HourlySeries *series, time_t start, int seconds,
+		      int columns, float *values)
+{
+	int i, column, count;
+
+	for (i = 0; i < columns; i++)
+		values[i] = NAN;
+
+	column = -1;
+	count = 0;
+	for (i = 0; i < series->length; i++) {
+		int c;
+
+		if (series->times[i] < start)
+			continue;
+		c = (series->times[i] - start) / seconds;
+		if (c >= columns)
+			break;
+		if (c != column) {
+			column = c;
+			count = 0;
+			values[c] = 0;
+		}
+		values[c] = (values[c] * count + series->temps[i]) / (count + 1);
+		count++;
+	}
+}
+
+/* replace the series with the samples that have a time and temperature,
+ * converting the temperatures from the given units */
+void fillHourlySeries(HourlySeries *series, const ForecastSample *samples,
+		      int length, GWeatherTemperatureUnit units)
+{
+	time_t start;
+	int i;
+
+	/* the nearest hours are the ones shown, so past ones are skipped
+	 * and the series stops when it is full */
+	start = time(NULL);
+	start -= start % 3600;
+
+	clearHourlySeries(series);
+	for (i = 0; i < length && series->length < series->capacity; i++) {
+		if (!samples[i].time || !samples[i].haveTemp ||
+		    samples[i].time < start)
+			continue;
+		appendHourly(series, samples[i].time,
+			     convertTemp(samples[i].temp, units,
+					 CANONICAL_UNITS),
+			     getIconSlot(samples[i].code));
+	}
+}
+
+/* seconds east of utc for the local time zone at time */
+long int getLocalOffset(time_t time)
+{
+	struct tm local;
+
+	localtime_r(&time, &local);
+	return local.tm_gmtoff;
+}
+
+/* days since the epoch in the local time zone, rounding towards negative
+ * infinity */
+static long int localDay(time_t time, long int offset)
+{
+	long long seconds = (long long)time + offset;
+
+	if (seconds < 0)
+		return -((-seconds - 1) / SECONDS_PER_DAY) - 1;
+	return seconds / SECONDS_PER_DAY;
+}
+
+/* split hourly samples, which come in chronological order, into one
+ * forecast per local day starting with today.  The time zone offset is
+ * looked up once, so a daylight saving change during the forecast moves
+ * the later days' boundaries by an hour. */
+void gather_forecasts(Weather *weather, const ForecastSample *samples,
+		      int length, int days)
+{
+	DayBucket buckets[MAX_FORECASTS];
+	long int offset, today;
+	int i, last;
+	time_t now;
+
+	if (days < 1)
+		return;
+	if (days > MAX_FORECASTS)
+		days = MAX_FORECASTS;
+
+	now = time(NULL);
+	offset = getLocalOffset(now);
+	today = localDay(now, offset);
+
+	memset(buckets, 0, days * sizeof(DayBucket));
+
+	/* the last day is only shown if there are samples after it, since
+	 * otherwise it probably isn't complete */
+	last = -1;
+	for (i = 0; i < length; i++) {
+		const ForecastSample *sample = &samples[i];
+		DayBucket *bucket;
+		long int day;
+
+		/* a sample without a temperature would count as 0° */
+		if (!sample->time || !sample->haveTemp)
+			continue;
+
+		day = localDay(sample->time, offset) - today;
+		if (day < 0)
+			continue;
+		if (day >= days) {
+			last = days;
+			break;
+		}
+		if (day > last)
+			last = day;
+
+		bucket = &buckets[day];
+		if (!bucket->samples) {
+			bucket->high = bucket->low = sample->temp;
+			bucket->conditions = "";
+		} else if (sample->temp > bucket->high)
+			bucket->high = sample->temp;
+		else if (sample->temp < bucket->low)
+			bucket->low = sample->temp;
+		bucket->samples++;
+
+		/* follow gnome weather's convention of using 2 pm for
+		 * conditions */
+		if (!*bucket->conditions && sample->conditions &&
+		    ((long long)sample->time + offset) % SECONDS_PER_DAY >=
+		    14 * 3600)
+			bucket->conditions = sample->conditions;
+	}
+
+	for (i = 0; i < last; i++) {
+		/* don't create forecast if we don't have any info (e.g., for
+		 * today if it's almost midnight) */
+		if (!buckets[i].samples)
+			continue;
+
+		/* january 1, 1970 was a thursday */
+		setForecast(appendForecast(&weather->forecasts),
+			    ((today + i) % 7 + 7 + 4) % 7,
+			    buckets[i].low, buckets[i].high,
+			    buckets[i].conditions);
+	}
+}
+
+static void appendCodepoint(TextBuilder *builder, unsigned long c)
+{
+	char utf8[4];
+	size_t length;
+
+	if (c < 0x80) {
+		utf8[0] = c;
+		length = 1;
+	} else if (c < 0x800) {
+		utf8[0] = 0xc0 | (c >> 6);
+		utf8[1] = 0x80 | (c & 0x3f);
+		length = 2;
+	} else if (c < 0x10000) {
+		utf8[0] = 0xe0 | (c >> 12);
+		utf8[1] = 0x80 | ((c >> 6) & 0x3f);
+		utf8[2] = 0x80 | (c & 0x3f);
+		length = 3;
+	} else {
+		utf8[0] = 0xf0 | (c >> 18);
+		utf8[1] = 0x80 | ((c >> 12) & 0x3f);
+		utf8[2] = 0x80 | ((c >> 6) & 0x3f);
+		utf8[3] = 0x80 | (c & 0x3f);
+		length = 4;
+	}
+	appendTextLength(builder, utf8, length);
+}
+
+/* decode the entity starting at text, returning its length, or 0 if it
+ * isn't one we know */
+static size_t appendEntity(TextBuilder *builder, const char *text,
+			   const char *end)
+{
+	static const struct {
+		const char *name;
+		const char *text;
+	} entities[] = {
+		{"&amp;", "&"},
+		{"&lt;", "<"},
+		{"&gt;", ">"},
+		{"&quot;", "\""},
+		{"&apos;", "'"},
+		{"&nbsp;", " "},
+		{"&copy;", "\xc2\xa9"}
+	};
+	const char *semicolon;
+	size_t i, length;
+
+	semicolon = memchr(text, ';', end - text);
+	if (!semicolon)
+		return 0;
+	length = semicolon - text + 1;
+
+	if (text[1] == '#') {
+		unsigned long c;
+		char *digitsEnd;
+
+		if (text[2] == 'x' || text[2] == 'X')
+			c = strtoul(text + 3, &digitsEnd, 16);
+		else
+			c = strtoul(text + 2, &digitsEnd, 10);
+		if (digitsEnd != semicolon || c == 0 || c > 0x10ffff)
+			return 0;
+		appendCodepoint(builder, c);
+		return length;
+	}
+
+	for (i = 0; i < sizeof(entities) / sizeof(entities[0]); i++) {
+		if (strlen(entities[i].name) == length &&
+		    strncmp(text, entities[i].name, length) == 0) {
+			appendText(builder, entities[i].text);
+			return length;
+		}
+	}
+
+	return 0;
+}
+
+static void appendDecoded(TextBuilder *builder, const char *text,
+			  const char *end)
+{
+	while (text < end) {
+		const char *ampersand;
+		size_t length;
+
+		ampersand = memchr(text, '&', end - text);
+		if (!ampersand) {
+			appendTextLength(builder, text, end - text);
+			return;
+		}
+
+		appendTextLength(builder, text, ampersand - text);
+		length = appendEntity(builder, ampersand, end);
+		if (!length) {
+			appendTextLength(builder, "&", 1);
+			length = 1;
+		}
+		text = ampersand + length;
+	}
+}
+
+/* the value of the href attribute in the tag between start and end */
+static const char *findHref(const char *start, const char *end,
+			    const char **hrefEnd)
+{
+	const char *p;
+
+	for (p = start; p + 4 < end; p++) {
+		char quote;
+
+		if (strncasecmp(p, "href", 4) != 0)
+			continue;
+
+		p += 4;
+		while (p < end && (*p == ' ' || *p == '\t' || *p == '\n'))
+			p++;
+		if (p == end || *p != '=')
+			continue;
+		p++;
+		while (p < end && (*p == ' ' || *p == '\t' || *p == '\n'))
+			p++;
+
+		quote = (*p == '"' || *p == '\'') ? *p++ : '\0';
+		*hrefEnd = p;
+		while (*hrefEnd < end && (quote ? **hrefEnd != quote :
+					 **hrefEnd != ' ' && **hrefEnd != '>'))
+			(*hrefEnd)++;
+		return p;
+	}
+
+	return NULL;
+}
+
+/* strip html from attribution string in a single pass, decoding entities
+ * and following each link's text with its target */
+char *strip_tags(const char *to_strip)
+{
+	TextBuilder builder;
+	const char *text, *end, *href, *hrefEnd;
+	size_t linkStart;
+
+	if (!to_strip)
+		return wstrdup("");
+
+	end = to_strip + strlen(to_strip);
+	initTextBuilder(&builder, end - to_strip + 1);
+	href = hrefEnd = NULL;
+	linkStart = 0;
+
+	for (text = to_strip; text < end; ) {
+		const char *open, *close;
+
+		open = memchr(text, '<', end - text);
+		if (!open) {
+			appendDecoded(&builder, text, end);
+			break;
+		}
+		appendDecoded(&builder, text, open);
+
+		close = memchr(open, '>', end - open);
+		if (!close) {
+			/* not a tag after all */
+			appendDecoded(&builder, open, end);
+			break;
+		}
+
+		if ((open[1] == 'a' || open[1] == 'A') &&
+		    (open[2] == ' ' || open[2] == '\t' || open[2] == '\n')) {
+			href = findHref(open + 2, close, &hrefEnd);
+			linkStart = builder.length;
+		} else if (href && open[1] == '/' &&
+			   (open[2] == 'a' || open[2] == 'A') &&
+			   (open[3] == '>' || open[3] == ' ')) {
+			size_t textLength = builder.length - linkStart;
+			TextBuilder target;
+
+			initTextBuilder(&target, hrefEnd - href + 1);
+			appendDecoded(&target, href, hrefEnd);
+			/* a link whose text is its target only needs it once */
+			if (target.length &&
+			    (textLength != target.length ||
+			     memcmp(builder.text + linkStart, target.text,
+				    textLength) != 0)) {
+				if (textLength)
+					appendTextf(&builder, " (%s)",
+						    target.text);
+				else
+					appendText(&builder, target.text);
+			}
+			wfree(finishText(&target));
+			href = NULL;
+		}
+
+		text = close + 1;
+	}
+
+	return finishText(&builder);
+}
+
+char *getIconFilename(const char *icondir, const char *code)
+{
+	char *filename;
+	size_t length;
+
+	length = strlen(icondir) + strlen(code) + sizeof("/.png");
+	filename = wmalloc(length);
+	snprintf(filename, length, "%s/%s.png", icondir, code);
+	return filename;
+}
+
+Bool check_icondir(char *icondir)
+{
+	int i, good;
+
+	good = True;
+
+	for (i = 0; i < (int)NUM_ICONS; i++) {
+		char *filename;
+
+		filename = getIconFilename(icondir, icon_names[i]);
+		good = access(filename, F_OK) == 0;
+		wfree(filename);
+		if (!good)
+			break;
+	}
+
+	return good;
+}
+
+const char *getPLDictionaryString(WMPropList *dictionary, const char *key)
+{
+	WMPropList *value;
+
+	if (!dictionary)
+		return NULL;
+
+	value = WMGetFromPLDictionary(dictionary, WMCreatePLString(key));
+	if (!value || !WMIsPLString(value))
+		return NULL;
+
+	return WMGetFromPLString(value);
+}
+
+/* microseconds on a clock that only goes forward */
+long long statsNow(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/* the time since started counts towards phase; the oldest duration is
+ * dropped once the window is full */
+void recordPhase(Phase phase, long long started)
+{
+	PhaseTimes *times = &refreshStats.phases[phase];
+
+	times->samples[times->next] = statsNow() - started;
+	times->next = (times->next + 1) % STATS_WINDOW;
+	if (times->length < STATS_WINDOW)
+		times->length++;
+}
+
+static int compareDurations(const void *a, const void *b)
+{
+	long long x = *(const long long *)a;
+	long long y = *(const long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* sorting only happens here, so recording stays cheap */
+void printRefreshStats(FILE *stream)
+{
+	long long sorted[STATS_WINDOW];
+	char when[32];
+	time_t now;
+	int i;
+
+	now = time(NULL);
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&now));
+	fprintf(stream, "wmforecast stats at %s\n", when);
+	fprintf(stream, "%-10s %6s %10s %10s %10s %10s\n", "phase (ms)",
+		"count", "min", "p50", "p99", "max");
+
+	for (i = 0; i < NUM_PHASES; i++) {
+		PhaseTimes *times = &refreshStats.phases[i];
+		int length = times->length;
+
+		if (!length) {
+			fprintf(stream, "%-10s %6d\n", phase_names[i], 0);
+			continue;
+		}
+
+		memcpy(sorted, times->samples, length * sizeof(long long));
+		qsort(sorted, length, sizeof(long long), compareDurations);
+		fprintf(stream, "%-10s %6d %10.3f %10.3f %10.3f %10.3f\n",
+			phase_names[i], length, sorted[0] / 1000.0,
+			sorted[length / 2] / 1000.0,
+			sorted[(length * 99) / 100] / 1000.0,
+			sorted[length - 1] / 1000.0);
+	}
+
+	fprintf(stream, "refreshes %lu, errors %lu, retries %lu, "
+		"balloon text %llu bytes\n\n", refreshStats.refreshes,
+		refreshStats.errors, refreshStats.retries,
+		refreshStats.balloonBytes);
+	fflush(stream);
+}
@@ -0,0 +1,367 @@
+/* Copyright (C) 2014-2023 Doug Torrance <dtorrance@piedmont.edu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* the provider results wmforecast builds its weather from, and recording
+ * them so that a refresh can be replayed without the network */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wmforecast.h"
+
+typedef struct {
+	char *attribution;
+	char *text;
+} CachedAttribution;
+
+/* providers send the same attribution every time, so only strip the ones
+ * we haven't seen */
+static CachedAttribution attributionCache[ATTRIBUTION_CACHE_SIZE];
+static int nextAttribution;
+
+double convertTemp(double temp, GWeatherTemperatureUnit from,
+		   GWeatherTemperatureUnit to)
+{
+	if (from == to)
+		return temp;
+
+	/* go through kelvin */
+	if (from == GWEATHER_TEMP_UNIT_CENTIGRADE)
+		temp += 273.15;
+	else if (from == GWEATHER_TEMP_UNIT_FAHRENHEIT)
+		temp = (temp - 32) * 5 / 9 + 273.15;
+
+	if (to == GWEATHER_TEMP_UNIT_CENTIGRADE)
+		temp -= 273.15;
+	else if (to == GWEATHER_TEMP_UNIT_FAHRENHEIT)
+		temp = (temp - 273.15) * 9 / 5 + 32;
+
+	return temp;
+}
+
+static void readSample(ForecastSample *sample, GWeatherInfo *info,
+		       GWeatherTemperatureUnit units, Arena *arena)
+{
+	char *text;
+
+	if (!gweather_info_get_value_update(info, &sample->time))
+		sample->time = 0;
+
+	sample->haveTemp = gweather_info_get_value_temp(info, units,
+							&sample->temp);
+	if (!sample->haveTemp)
+		sample->temp = 0;
+
+	text = gweather_info_get_conditions(info);
+	if (strcmp(text, "-") == 0) {
+		g_free(text);
+		text = gweather_info_get_sky(info);
+	}
+	sample->conditions = arenaStrdup(arena, text);
+	g_free(text);
+
+	text = gweather_info_get_weather_summary(info);
+	sample->summary = arenaStrdup(arena, text);
+	g_free(text);
+
+	sample->code = arenaStrdup(arena, gweather_info_get_icon_name(info));
+}
+
+/* copy what we need out of a finished GWeatherInfo */
+ProviderResult *readProviderResult(GWeatherInfo *info,
+				   GWeatherTemperatureUnit units,
+				   Arena *arena)
+{
+	ProviderResult *result;
+	GWeatherInfo *detailed;
+	GSList *gforecasts;
+	int i;
+
+	result = arenaAlloc(arena, sizeof(ProviderResult));
+	result->valid = gweather_info_is_valid(info);
+	result->units = units;
+	result->attribution = arenaStrdup(arena,
+					  gweather_info_get_attribution(info));
+	readSample(&result->current, info, units, arena);
+
+	gforecasts = gweather_info_get_forecast_list(info);
+	result->length = g_slist_length(gforecasts);
+	result->samples = arenaAlloc(arena, (result->length + 1) *
+				     sizeof(ForecastSample));
+
+	/* without current conditions, the next forecasted ones are shown */
+	detailed = result->current.haveTemp ? info : NULL;
+	for (i = 0; gforecasts; gforecasts = gforecasts->next, i++) {
+		readSample(&result->samples[i], gforecasts->data, units, arena);
+		if (!detailed && result->samples[i].haveTemp)
+			detailed = gforecasts->data;
+	}
+
+	result->details = NULL;
+	if (detailed) {
+		char *text;
+
+		text = getConditionsText(detailed);
+		result->details = arenaStrdup(arena, text);
+		wfree(text);
+	}
+
+	return result;
+}
+
+/* the attribution with its html stripped, which stays valid until
+ * ATTRIBUTION_CACHE_SIZE other attributions have been seen */
+const char *getAttributionText(const char *attribution)
+{
+	CachedAttribution *cached;
+	int i;
+
+	if (!attribution)
+		return "";
+
+	for (i = 0; i < ATTRIBUTION_CACHE_SIZE; i++) {
+		cached = &attributionCache[i];
+		if (cached->attribution &&
+		    strcmp(cached->attribution, attribution) == 0)
+			return cached->text;
+	}
+
+	cached = &attributionCache[nextAttribution];
+	nextAttribution = (nextAttribution + 1) % ATTRIBUTION_CACHE_SIZE;
+	if (cached->attribution) {
+		wfree(cached->attribution);
+		wfree(cached->text);
+	}
+	cached->attribution = wstrdup(attribution);
+	cached->text = strip_tags(attribution);
+
+	return cached->text;
+}
+
+/* turn a provider result into a Weather allocated from arena, with the
+ * temperatures in CANONICAL_UNITS */
+Weather *buildWeather(ProviderResult *result, int days, Arena *arena)
+{
+	const ForecastSample *current, *samples;
+	Weather *weather;
+	double temp;
+	int i;
+
+	weather = newWeather(arena);
+
+	if (!result->valid)
+		setError(weather, result->current.summary);
+
+	weather->attribution = arenaStrdup(
+		weather->arena, getAttributionText(result->attribution));
+
+	samples = result->samples;
+	if (result->units != CANONICAL_UNITS) {
+		ForecastSample *converted;
+
+		converted = arenaAlloc(arena, (result->length + 1) *
+				       sizeof(ForecastSample));
+		for (i = 0; i < result->length; i++) {
+			converted[i] = samples[i];
+			converted[i].temp = convertTemp(samples[i].temp,
+							result->units,
+							CANONICAL_UNITS);
+		}
+		samples = converted;
+	}
+	gather_forecasts(weather, samples, result->length, days);
+
+	/* check if we have current conditions, and if we don't, get the next
+	 * forecasted ones */
+	current = &result->current;
+	temp = convertTemp(current->temp, result->units, CANONICAL_UNITS);
+	if (!current->haveTemp) {
+		for (i = 0; i < result->length; i++)
+			if (samples[i].haveTemp)
+				break;
+
+		if (i < result->length) {
+			/* already converted */
+			current = &samples[i];
+			temp = current->temp;
+		} else
+			setError(weather, "Retrieval failed");
+	}
+
+	setConditions(weather, temp, current->summary, current->code);
+
+	/* keep a copy of the detailed conditions so the balloon can be
+	 * switched without fetching them again */
+	if (!weather->errorFlag)
+		weather->conditions = arenaStrdup(weather->arena,
+						  result->details);
+
+	return weather;
+}
+
+static WMPropList *sampleToPropList(const ForecastSample *sample)
+{
+	WMPropList *dictionary;
+	char number[32];
+
+	dictionary = WMCreatePLDictionary(NULL, NULL);
+
+	if (sample->time) {
+		snprintf(number, sizeof(number), "%lld",
+			 (long long)sample->time);
+		WMPutInPLDictionary(dictionary, WMCreatePLString("time"),
+				    WMCreatePLString(number));
+	}
+	if (sample->haveTemp) {
+		snprintf(number, sizeof(number), "%.2f", sample->temp);
+		WMPutInPLDictionary(dictionary, WMCreatePLString("temp"),
+				    WMCreatePLString(number));
+	}
+	if (sample->conditions)
+		WMPutInPLDictionary(dictionary, WMCreatePLString("conditions"),
+				    WMCreatePLString(sample->conditions));
+	if (sample->summary)
+		WMPutInPLDictionary(dictionary, WMCreatePLString("summary"),
+				    WMCreatePLString(sample->summary));
+	if (sample->code)
+		WMPutInPLDictionary(dictionary, WMCreatePLString("code"),
+				    WMCreatePLString(sample->code));
+
+	return dictionary;
+}
+
+/* missing keys are allowed, so recordings can be trimmed by hand to
+ * reproduce partial data */
+static void sampleFromPropList(ForecastSample *sample, WMPropList *dictionary,
+			       Arena *arena)
+{
+	const char *value;
+
+	if (!WMIsPLDictionary(dictionary))
+		dictionary = NULL;
+
+	value = getPLDictionaryString(dictionary, "time");
+	sample->time = value ? (time_t)atoll(value) : 0;
+	value = getPLDictionaryString(dictionary, "temp");
+	sample->haveTemp = value != NULL;
+	sample->temp = value ? atof(value) : 0;
+	sample->conditions = arenaStrdup(
+		arena, getPLDictionaryString(dictionary, "conditions"));
+	if (!sample->conditions)
+		sample->conditions = "";
+	sample->summary = arenaStrdup(
+		arena, getPLDictionaryString(dictionary, "summary"));
+	if (!sample->summary)
+		sample->summary = "";
+	sample->code = arenaStrdup(
+		arena, getPLDictionaryString(dictionary, "code"));
+	if (!sample->code)
+		sample->code = "dialog-error";
+}
+
+Bool saveProviderResult(ProviderResult *result, const char *filename)
+{
+	WMPropList *recording, *samples;
+	char number[32];
+	Bool success;
+	int i;
+
+	recording = WMCreatePLDictionary(NULL, NULL);
+
+	snprintf(number, sizeof(number), "%d", RECORDING_VERSION);
+	WMPutInPLDictionary(recording, WMCreatePLString("version"),
+			    WMCreatePLString(number));
+	WMPutInPLDictionary(recording, WMCreatePLString("valid"),
+			    WMCreatePLString(result->valid ? "yes" : "no"));
+	WMPutInPLDictionary(
+		recording, WMCreatePLString("units"),
+		WMCreatePLString(result->units == GWEATHER_TEMP_UNIT_CENTIGRADE
+				 ? "c" : "f"));
+	if (result->attribution)
+		WMPutInPLDictionary(recording, WMCreatePLString("attribution"),
+				    WMCreatePLString(result->attribution));
+	if (result->details)
+		WMPutInPLDictionary(recording, WMCreatePLString("details"),
+				    WMCreatePLString(result->details));
+	WMPutInPLDictionary(recording, WMCreatePLString("current"),
+			    sampleToPropList(&result->current));
+
+	samples = WMCreatePLArray(NULL);
+	for (i = 0; i < result->length; i++)
+		WMAddToPLArray(samples, sampleToPropList(&result->samples[i]));
+	WMPutInPLDictionary(recording, WMCreatePLString("forecasts"), samples);
+
+	success = WMWritePropListToFile(recording, filename);
+	WMReleasePropList(recording);
+
+	return success;
+}
+
+/* returns NULL if filename isn't a recording we understand */
+ProviderResult *loadProviderResult(const char *filename, Arena *arena)
+{
+	ProviderResult *result;
+	WMPropList *recording, *current, *samples;
+	const char *version, *valid, *units;
+	int i;
+
+	recording = WMReadPropListFromFile(filename);
+	if (!recording)
+		return NULL;
+
+	result = NULL;
+	if (!WMIsPLDictionary(recording))
+		goto out;
+
+	version = getPLDictionaryString(recording, "version");
+	valid = getPLDictionaryString(recording, "valid");
+	units = getPLDictionaryString(recording, "units");
+	current = WMGetFromPLDictionary(recording,
+					WMCreatePLString("current"));
+	samples = WMGetFromPLDictionary(recording,
+					WMCreatePLString("forecasts"));
+
+	if (!version || atoi(version) != RECORDING_VERSION || !units ||
+	    !current || !WMIsPLDictionary(current))
+		goto out;
+
+	result = arenaAlloc(arena, sizeof(ProviderResult));
+	result->valid = !valid || strcmp(valid, "no") != 0;
+	result->units = units[0] == 'c' ? GWEATHER_TEMP_UNIT_CENTIGRADE :
+		GWEATHER_TEMP_UNIT_FAHRENHEIT;
+	result->attribution = arenaStrdup(
+		arena, getPLDictionaryString(recording, "attribution"));
+	result->details = arenaStrdup(
+		arena, getPLDictionaryString(recording, "details"));
+	sampleFromPropList(&result->current, current, arena);
+
+	result->length = 0;
+	if (samples && WMIsPLArray(samples))
+		result->length = WMGetPropListItemCount(samples);
+	result->samples = arenaAlloc(arena, (result->length + 1) *
+				     sizeof(ForecastSample));
+	for (i = 0; i < result->length; i++)
+		sampleFromPropList(&result->samples[i],
+				   WMGetFromPLArray(samples, i), arena);
+
+out:
+	WMReleasePropList(recording);
+	return result;
+}
@@ -21,41 +21,90 @@
 #include <geoclue.h>
 #endif
 
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
-#define GWEATHER_I_KNOW_THIS_IS_UNSTABLE
-#include <libgweather/gweather.h>
+#include <math.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef HAVE_SYS_TIMERFD_H
+#include <sys/timerfd.h>
+#endif
 #include <time.h>
+#include <unistd.h>
 #include <WINGs/WINGs.h>
 
+#include "wmforecast.h"
+
 #define DEFAULT_TEXT_COLOR "light sea green"
 #define DEFAULT_BG_COLOR "black"
 #define APPLICATION_ID "org.friedcheese.wmforecast"
 #define CONTACT_INFO "dtorrance@piedmont.edu"
 #define COPYRIGHT_YEARS "2014-2023"
+#define CACHE_VERSION 3
+#define RETRY_BASE 60 /* seconds */
+#define REFRESH_BATCH_WINDOW 60 /* seconds */
+#define SPARKLINE_WIDTH 18
+#define SPARKLINE_HEIGHT 32
+#define SPARKLINE_HOURS 2 /* per column */
 
 #define icondir_warning(tried, current) \
 	wwarning("%s is not a valid icon directory; falling back to %s", \
 		 tried, current)
 
-#define round(x) (int)(x + 0.5)
+typedef struct {
+	double latitude;
+	double longitude;
+	/* nearest city for (locationLatitude, locationLongitude) */
+	GWeatherLocation *location;
+	double locationLatitude;
+	double locationLongitude;
+} Place;
+
+typedef enum {
+	MODE_ICON,
+	MODE_GRAPH /* a temperature sparkline next to the icon */
+} DisplayMode;
 
 typedef struct {
 	Bool geoclue;
 	GWeatherTemperatureUnit units;
-	double latitude;
-	double longitude;
+	/* each place gets its own tile; the first one is the "latitude" and
+	 * "longitude" defaults and the rest are "locations" */
+	int numPlaces;
+	Place *places;
+	/* -L was given, so the "locations" default is neither used nor
+	 * overwritten */
+	Bool placesFromCommandLine;
 	long int interval;
+	long int retry;
 	const char *background;
 	const char *text;
 	const char *icondir;
 	Bool windowed;
+	Bool dump;
+	/* directories provider results are written to or read back from
+	 * instead of the network */
+	const char *recordDir;
+	const char *replayDir;
+	const char *statsFile; /* NULL for stderr */
 	int days;
+	DisplayMode mode;
 	WMUserDefaults *defaults;
 } Preferences;
 
+/* what every tile has to redo when saved preferences differ from the ones
+ * they are showing; a tile whose location moved fetches again */
+typedef enum {
+	CHANGED_INTERVAL = 1 << 0, /* reschedule */
+	CHANGED_COLORS = 1 << 1, /* redraw */
+	CHANGED_UNITS = 1 << 2,
+	CHANGED_ICONDIR = 1 << 3
+} PreferenceChange;
+
 typedef struct {
 	Preferences *prefs;
 	WMButton *celsius;
@@ -85,199 +134,194 @@ typedef struct {
 	WMWindow *window;
 } PreferencesWindow;
 
+typedef struct {
+	double x;
+	double y;
+	double z;
+	GWeatherLocation *location;
+} CityPoint;
+
+/* k-d tree of every city in the world database, keyed by its position on
+ * the unit sphere, stored implicitly in a flat array */
+typedef struct {
+	int length;
+	int capacity;
+	CityPoint *points;
+} CityIndex;
+
+typedef struct {
+	GWeatherInfo *info;
+	gulong updatedHandler;
+	double latitude;
+	double longitude;
+} WeatherSession;
+
+/* the configured colors, shared by everything that draws */
+typedef struct {
+	char *backgroundName;
+	char *textName;
+	WMColor *background;
+	WMColor *text;
+	RColor rbackground;
+	RColor rtext;
+} Palette;
+
+/* icons composited onto the background, ready to be displayed, one for
+ * each IconSlot */
+typedef struct {
+	char *icondir;
+	char *background;
+	WMPixmap *pixmaps[NUM_ICONS];
+} IconCache;
+
+/* the upcoming temperatures drawn straight into an image, one column per
+ * SPARKLINE_HOURS; only columns whose height changed are redrawn */
+typedef struct {
+	RImage *image;
+	WMPixmap *pixmap;
+	int heights[SPARKLINE_WIDTH]; /* 0 for no data */
+	Bool stale; /* every column needs to be redrawn */
+} Sparkline;
+
+/* a single one-shot timer for the next refresh, armed from an absolute
+ * deadline */
+typedef struct {
+	long long deadline;
+	clockid_t clock; /* the timerfd's, which deadlines are measured on */
+	WMCallback *callback;
+	void *data;
+	WMHandlerID timer;
+	int fd;
+	WMHandlerID input;
+} RefreshScheduler;
+
+/* exponential backoff after failed refreshes */
+typedef struct {
+	int failures;
+	long int delay; /* seconds until the retry currently scheduled */
+} RetryPolicy;
+
 typedef struct {
 	int prefsWindowPresent;
 	int showForecast;
-	long int minutesLeft;
+	struct DockappList *list;
+	int place;
+	long long due;
+	int updates; /* provider results received so far */
+	long long fetchStarted; /* statsNow() when the update was requested */
+	RetryPolicy *retry;
+	struct Weather *weather;
+	/* the hourly forecast from the last provider update */
+	HourlySeries *hourly;
+	/* the current weather lives in one arena while the next refresh is
+	 * built in the other */
+	Arena *arenas[2];
+	IconCache *icons;
+	Palette *palette;
 	Preferences *prefs;
+	WeatherSession *session;
 	PreferencesWindow *prefsWindow;
 	WMFrame *frame;
 	WMLabel *icon;
 	WMLabel *text;
+	WMLabel *graph; /* NULL unless prefs->mode is MODE_GRAPH */
+	Sparkline *sparkline;
 	WMScreen *screen;
+	/* what the widgets currently show, so unchanged content isn't sent
+	 * to the X server again */
+	char *shownLabel;
+	WMPixmap *shownIcon;
+	char *shownBalloon;
 } Dockapp;
 
+/* every tile in the process, sharing one refresh timer, palette and icon
+ * cache */
+typedef struct DockappList {
+	int length;
+	Dockapp **dockapps;
+	RefreshScheduler *scheduler;
+	Palette *palette;
+	IconCache *icons;
+} DockappList;
+
+/* the glib main context's file descriptors and next timeout, as watched
+ * by the WINGs event loop */
 typedef struct {
-	char *day;
-	char *low;
-	char *high;
-	char *text;
-} Forecast;
-
+	GMainContext *context;
+	int maxPriority;
+	int nfds;
+	int allocated;
+	GPollFD *fds;
+	GPollFD *oldfds;
+	WMHandlerID *handlers;
+	WMHandlerID timer;
+} GlibLoop;
+
+/* one location in --dump mode */
 typedef struct {
-	int length;
-	Forecast *forecasts;
-} ForecastArray;
+	Preferences *prefs;
+	Place *place;
+	GWeatherInfo *info;
+	Arena *arena;
+	struct Weather *weather;
+	int *pending;
+	GMainLoop *loop;
+} DumpJob;
 
-typedef struct {
-	char *temp;
-	char *text;
-	ForecastArray *forecasts;
-	RImage *icon;
-	int errorFlag;
-	char *errorText;
-	char retrieved[20];
-	const char *attribution;
-	GWeatherTemperatureUnit units;
-} Weather;
-
-Forecast *newForecast(void);
-ForecastArray *newForecastArray(void);
-void appendForecast(ForecastArray *array, Forecast *forecast);
-Weather *newWeather(void);
-void freeForecast(Forecast *forecast);
-void freeForecastArray(ForecastArray *array);
-void freeWeather(Weather *weather);
-void setError(Weather *weather, const char *errorText);
-void setConditions(
-	Weather *weather, WMScreen *screen, const char *temp, const char *text,
-	const char *code, const char *background, const char *icondir);
-void setForecast(Forecast *forecast, const char *day, const char *low,
-		 const char *high, const char *text);
 void close_window(WMWidget *self, void *data);
 WMWindow *WMCreateDockapp(WMScreen *screen, const char *name, int argc,
 			  char **argv, Bool windowed);
-Dockapp *newDockapp(WMScreen *screen, Preferences *prefs,
-		    int argc, char **argv);
-char *getForecastText(Weather *weather, int days);
-char *getConditionsText(GWeatherInfo *info);
-char *getTemp(GWeatherInfo *info, GWeatherTemperatureUnit unit);
-void gather_forecasts(Weather *weather, GSList *gforecasts);
-char *strip_tags(const char *to_strip);
+Dockapp *newDockapp(DockappList *list, WMScreen *screen, Preferences *prefs,
+		    int place, int argc, char **argv);
+Place *getPlace(Dockapp *dockapp);
+Palette *newPalette(void);
+void setPalette(Palette *palette, WMScreen *screen, Preferences *prefs);
+IconCache *newIconCache(void);
+void clearIconCache(IconCache *cache);
+WMPixmap *getIcon(IconCache *cache, WMScreen *screen, const char *icondir,
+		  Palette *palette, const char *code);
+Sparkline *newSparkline(void);
+CityIndex *getCityIndex(void);
+GWeatherLocation *findNearestCity(double latitude, double longitude);
+GWeatherLocation *getLocation(Place *place);
+WeatherSession *newWeatherSession(void);
+void clearWeatherSession(WeatherSession *session);
+char *getCacheFilename(Place *place);
+void saveWeatherCache(Place *place, Weather *weather);
+Weather *loadWeatherCache(Place *place, Arena *arena);
+void showBalloon(Dockapp *dockapp);
+void showWeather(Dockapp *dockapp, Weather *weather);
+char *getRecordingFilename(const char *directory, Place *place, int index);
+void recordProviderResult(Preferences *prefs, Place *place, int index,
+			  ProviderResult *result);
+ProviderResult *replayProviderResult(Preferences *prefs, Place *place,
+				     int *index, Arena *arena);
 void getWeather(GWeatherInfo *info, Dockapp *dockapp);
-Bool check_icondir(char *icondir);
+GWeatherInfo *newWeatherInfo(GWeatherLocation *location);
+void printJsonString(FILE *stream, const char *text);
+void printWeatherJson(FILE *stream, Place *place, Weather *weather, int days,
+		      GWeatherTemperatureUnit units);
+int dumpWeather(Preferences *prefs);
 GWeatherTemperatureUnit string_to_unit(char *unit_string);
+DisplayMode string_to_mode(const char *mode_string);
+Bool parsePlace(const char *text, double *latitude, double *longitude);
+long int parseInterval(const char *text);
+long int getRefreshSeconds(Preferences *prefs);
+void setPlace(Place *place, double latitude, double longitude);
+void addPlace(Preferences *prefs, double latitude, double longitude);
+void truncatePlaces(Preferences *prefs, int numPlaces);
 void readPreferences(Preferences *prefs);
 Preferences *setPreferences(int argc, char **argv);
-void do_glib_loop(void *data);
+GlibLoop *newGlibLoop(void);
+RefreshScheduler *newRefreshScheduler(WMCallback *callback, void *data);
+void scheduleRefreshAt(RefreshScheduler *scheduler, long long deadline);
+DockappList *newDockappList(WMScreen *screen);
+void scheduleDockapp(Dockapp *dockapp, long int seconds);
+RetryPolicy *newRetryPolicy(void);
+long int nextRetryDelay(RetryPolicy *policy, long int ceiling);
+void resetRetryPolicy(RetryPolicy *policy);
 void restore_default_colors(WMWidget *widget, void *data);
-
-Forecast *newForecast(void)
-{
-	Forecast *forecast = wmalloc(sizeof(Forecast));
-	forecast->day = NULL;
-	forecast->low = NULL;
-	forecast->high = NULL;
-	forecast->text = NULL;
-	return forecast;
-}
-
-ForecastArray *newForecastArray(void)
-{
-	ForecastArray *array = wmalloc(sizeof(ForecastArray));
-	array->length = 0;
-	array->forecasts = NULL;
-	return array;
-}
-
-void appendForecast(ForecastArray *array, Forecast *forecast)
-{
-	array->length++;
-	array->forecasts = (Forecast *)wrealloc(array->forecasts, sizeof(Forecast)*(array->length));
-	array->forecasts[(array->length)-1] = *forecast;
-}
-
-Weather *newWeather(void)
-{
-	Weather *weather = wmalloc(sizeof(Weather));
-	weather->temp = NULL;
-	weather->text = NULL;
-	weather->icon = NULL;
-	weather->forecasts = newForecastArray();
-	weather->errorFlag = 0;
-	weather->errorText = NULL;
-	return weather;
-}
-
-void freeForecast(Forecast *forecast)
-{
-	wfree(forecast->day);
-	wfree(forecast->low);
-	wfree(forecast->high);
-	wfree(forecast->text);
-}
-
-void freeForecastArray(ForecastArray *array)
-{
-	int i;
-	for (i = 0; i < array->length; i++)
-		if (&array->forecasts[i])
-			freeForecast(&array->forecasts[i]);
-	wfree(array);
-}
-
-void freeWeather(Weather *weather)
-{
-	wfree(weather->temp);
-	wfree(weather->text);
-	if (weather->forecasts)
-		freeForecastArray(weather->forecasts);
-	wfree(weather->errorText);
-	wfree(weather);
-}
-
-void setError(Weather *weather, const char *errorText)
-{
-	weather->errorFlag = 1;
-	if (errorText) {
-		weather->errorText = wrealloc(
-			weather->errorText, strlen(errorText) + 1);
-		strcpy(weather->errorText, errorText);
-	} else
-		weather->errorText = wstrdup("An error occurred");
-}
-
-void setConditions(Weather *weather,
-		   WMScreen *screen,
-		   const char *temp,
-		   const char *text,
-		   const char *code,
-		   const char *background,
-		   const char *icondir
-	)
-{
-	RContext *context;
-	char filename[1024];
-	time_t currentTime;
-
-
-	weather->temp = wstrdup(temp);
-	weather->text = wstrdup(text);
-
-	context = WMScreenRContext(screen);
-	sprintf(filename, "%s/%s.png", icondir, code);
-
-	weather->icon = RLoadImage(context, filename, 0);
-	if (!weather->icon) {
-		setError(weather, wstrconcat(filename, " not found"));
-	} else {
-		RColor color;
-		color = WMGetRColorFromColor(
-			WMCreateNamedColor(screen, background, True));
-		RCombineImageWithColor(weather->icon, &color);
-	}
-
-	currentTime = time(NULL);
-	strftime(weather->retrieved, sizeof weather->retrieved, "%l:%M %p %Z",
-		 localtime(&currentTime));
-}
-
-void setForecast(Forecast *forecast,
-		 const char *day,
-		 const char *low,
-		 const char *high,
-		 const char *text
-	)
-{
-	forecast->day = wrealloc(forecast->day, strlen(day) + 1);
-	strcpy(forecast->day, day);
-	forecast->low = wrealloc(forecast->low, strlen(low) + 1);
-	strcpy(forecast->low, low);
-	forecast->high = wrealloc(forecast->high, strlen(high) + 1);
-	strcpy(forecast->high, high);
-	forecast->text = wrealloc(forecast->text, strlen(text) + 1);
-	strcpy(forecast->text, text);
-}
+void watchStatsSignal(Preferences *prefs);
 
 void close_window(WMWidget *self, void *data)
 {
@@ -321,7 +365,8 @@ WMWindow *WMCreateDockapp(WMScreen *screen, const char *name, int argc,
 	return dockapp;
 }
 
-Dockapp *newDockapp(WMScreen *screen, Preferences *prefs, int argc, char **argv)
+Dockapp *newDockapp(DockappList *list, WMScreen *screen, Preferences *prefs,
+		    int place, int argc, char **argv)
 {
 	Dockapp *dockapp = wmalloc(sizeof(Dockapp));
 	WMColor *background;
@@ -330,23 +375,31 @@ Dockapp *newDockapp(WMScreen *screen, Preferences *prefs, int argc, char **argv)
 
 	dockapp->screen = screen;
 	dockapp->prefs = prefs;
-	dockapp->minutesLeft = prefs->interval;
+	dockapp->list = list;
+	dockapp->place = place;
+	dockapp->due = 0;
+	dockapp->updates = 0;
+	dockapp->fetchStarted = 0;
+	dockapp->retry = newRetryPolicy();
+	dockapp->weather = NULL;
+	dockapp->hourly = newHourlySeries(HOURLY_CAPACITY);
+	dockapp->arenas[0] = newArena();
+	dockapp->arenas[1] = newArena();
+	dockapp->icons = list->icons;
+	dockapp->palette = list->palette;
 	dockapp->prefsWindowPresent = 0;
 	dockapp->showForecast = 1;
+	dockapp->session = newWeatherSession();
+	dockapp->shownLabel = NULL;
+	dockapp->shownIcon = NULL;
+	dockapp->shownBalloon = NULL;
 
 	window = WMCreateDockapp(screen, "", argc, argv, prefs->windowed);
 	WMSetWindowTitle(window, "wmforecast");
 
-	background = WMCreateNamedColor(screen, prefs->background, True);
-	if (!background) {
-		background = WMCreateNamedColor(screen, DEFAULT_BG_COLOR, True);
-		prefs->background = DEFAULT_BG_COLOR;
-	}
-	text = WMCreateNamedColor(screen, prefs->text, True);
-	if (!text) {
-		text = WMCreateNamedColor(screen, DEFAULT_TEXT_COLOR, True);
-		prefs->text = DEFAULT_TEXT_COLOR;
-	}
+	setPalette(dockapp->palette, screen, prefs);
+	background = dockapp->palette->background;
+	text = dockapp->palette->text;
 
 	dockapp->frame = WMCreateFrame(window);
 	WMSetFrameRelief(dockapp->frame, WRSunken);
@@ -372,409 +425,1397 @@ Dockapp *newDockapp(WMScreen *screen, Preferences *prefs, int argc, char **argv)
 	WMRealizeWidget(dockapp->icon);
 	WMSetLabelImagePosition(dockapp->icon, WIPImageOnly);
 	WMResizeWidget(dockapp->icon, 32, 32);
-	WMMoveWidget(dockapp->icon, 12, 5);
+
+	dockapp->graph = NULL;
+	dockapp->sparkline = NULL;
+	if (prefs->mode == MODE_GRAPH) {
+		WMMoveWidget(dockapp->icon, 2, 5);
+
+		dockapp->sparkline = newSparkline();
+		dockapp->graph = WMCreateLabel(dockapp->frame);
+		WMSetWidgetBackgroundColor(dockapp->graph, background);
+		WMRealizeWidget(dockapp->graph);
+		WMSetLabelImagePosition(dockapp->graph, WIPImageOnly);
+		WMResizeWidget(dockapp->graph, SPARKLINE_WIDTH,
+			       SPARKLINE_HEIGHT);
+		WMMoveWidget(dockapp->graph, 36, 5);
+	} else
+		WMMoveWidget(dockapp->icon, 12, 5);
 
 	WMMapWidget(window);
 	WMMapWidget(dockapp->frame);
 	WMMapSubwidgets(dockapp->frame);
 
+	list->dockapps = wrealloc(list->dockapps,
+				  (list->length + 1) * sizeof(Dockapp *));
+	list->dockapps[list->length++] = dockapp;
+
 	return dockapp;
 }
 
-char *getForecastText(Weather *weather, int days)
+Place *getPlace(Dockapp *dockapp)
 {
-	char *text;
+	return &dockapp->prefs->places[dockapp->place];
+}
+
+/* the cache is keyed by coordinates so several dockapps watching the same
+ * place share one file */
+char *getCacheFilename(Place *place)
+{
+	char name[64];
+
+	snprintf(name, sizeof(name), "%.4f,%.4f.plist", place->latitude,
+		 place->longitude);
+	return g_build_filename(g_get_user_cache_dir(), "wmforecast", name,
+				NULL);
+}
+
+void saveWeatherCache(Place *place, Weather *weather)
+{
+	WMPropList *cache, *forecasts;
+	char *filename, *directory, number[32];
 	int i;
 
-	text = wstrdup("\n"PACKAGE_STRING);
-	text = wstrappend(text, "\n\nRetrieved: ");
-	text = wstrappend(text, weather->retrieved);
-	text = wstrappend(text, "\n\nCurrent Conditions:\n");
-	text = wstrappend(text, weather->text);
-	text = wstrappend(text, ", ");
-	text = wstrappend(text, weather->temp);
+	cache = WMCreatePLDictionary(NULL, NULL);
+
+	snprintf(number, sizeof(number), "%d", CACHE_VERSION);
+	WMPutInPLDictionary(cache, WMCreatePLString("version"),
+			    WMCreatePLString(number));
+	snprintf(number, sizeof(number), "%.4f", place->latitude);
+	WMPutInPLDictionary(cache, WMCreatePLString("latitude"),
+			    WMCreatePLString(number));
+	snprintf(number, sizeof(number), "%.4f", place->longitude);
+	WMPutInPLDictionary(cache, WMCreatePLString("longitude"),
+			    WMCreatePLString(number));
+	snprintf(number, sizeof(number), "%lld", (long long)weather->timestamp);
+	WMPutInPLDictionary(cache, WMCreatePLString("timestamp"),
+			    WMCreatePLString(number));
+	WMPutInPLDictionary(cache, WMCreatePLString("retrieved"),
+			    WMCreatePLString(weather->retrieved));
+	snprintf(number, sizeof(number), "%.2f", weather->temp);
+	WMPutInPLDictionary(cache, WMCreatePLString("temp"),
+			    WMCreatePLString(number));
+	WMPutInPLDictionary(cache, WMCreatePLString("text"),
+			    WMCreatePLString(weather->text));
+	WMPutInPLDictionary(cache, WMCreatePLString("code"),
+			    WMCreatePLString(weather->code));
+	WMPutInPLDictionary(cache, WMCreatePLString("attribution"),
+			    WMCreatePLString(weather->attribution));
+
+	forecasts = WMCreatePLArray(NULL);
+	for (i = 0; i < weather->forecasts.length; i++) {
+		Forecast *forecast = &weather->forecasts.forecasts[i];
+		char weekday[4], low[32], high[32];
+
+		snprintf(weekday, sizeof(weekday), "%d", forecast->weekday);
+		snprintf(low, sizeof(low), "%.2f", forecast->low);
+		snprintf(high, sizeof(high), "%.2f", forecast->high);
+		WMAddToPLArray(forecasts, WMCreatePLDictionary(
+				       WMCreatePLString("weekday"),
+				       WMCreatePLString(weekday),
+				       WMCreatePLString("low"),
+				       WMCreatePLString(low),
+				       WMCreatePLString("high"),
+				       WMCreatePLString(high),
+				       WMCreatePLString("text"),
+				       WMCreatePLString(forecast->text),
+				       NULL));
+	}
+	WMPutInPLDictionary(cache, WMCreatePLString("forecasts"), forecasts);
 
-	text = wstrappend(text, "°\n\nForecast");
+	filename = getCacheFilename(place);
+	directory = g_path_get_dirname(filename);
+	if (g_mkdir_with_parents(directory, 0700) != 0 ||
+	    !WMWritePropListToFile(cache, filename))
+		wwarning("could not write forecast cache %s", filename);
 
-	if (weather->forecasts->length == 0)
-		text = wstrappend(text, " not available.");
-	else {
-		text = wstrappend(text, ":\n");
-		for (i = 0; i < weather->forecasts->length && i < days; i++) {
-			text = wstrappend(text,
-					  weather->forecasts->forecasts[i].day);
-			text = wstrappend(text, " - ");
-			text = wstrappend(text,
-					  weather->forecasts->forecasts[i].text);
-			text = wstrappend(text,
-					  ". High: ");
-			text = wstrappend(text,
-					  weather->forecasts->forecasts[i].high);
-			text = wstrappend(text,
-					  "° Low: ");
-			text = wstrappend(text,
-					  weather->forecasts->forecasts[i].low);
-			text = wstrappend(text, "°\n");
-		}
+	g_free(directory);
+	g_free(filename);
+	WMReleasePropList(cache);
+}
+
+/* returns NULL if there is no usable cache for the current location */
+Weather *loadWeatherCache(Place *place, Arena *arena)
+{
+	WMPropList *cache, *forecasts;
+	Weather *weather;
+	char *filename, number[32];
+	const char *version, *latitude, *longitude, *timestamp,
+		*retrieved, *temp, *text, *code, *attribution;
+	int i;
+
+	filename = getCacheFilename(place);
+	cache = WMReadPropListFromFile(filename);
+	g_free(filename);
+	if (!cache)
+		return NULL;
+
+	weather = NULL;
+	if (!WMIsPLDictionary(cache))
+		goto out;
+
+	version = getPLDictionaryString(cache, "version");
+	latitude = getPLDictionaryString(cache, "latitude");
+	longitude = getPLDictionaryString(cache, "longitude");
+	timestamp = getPLDictionaryString(cache, "timestamp");
+	retrieved = getPLDictionaryString(cache, "retrieved");
+	temp = getPLDictionaryString(cache, "temp");
+	text = getPLDictionaryString(cache, "text");
+	code = getPLDictionaryString(cache, "code");
+	attribution = getPLDictionaryString(cache, "attribution");
+	forecasts = WMGetFromPLDictionary(cache,
+					  WMCreatePLString("forecasts"));
+
+	if (!version || !latitude || !longitude || !timestamp ||
+	    !retrieved || !temp || !text || !code || !attribution ||
+	    !forecasts || !WMIsPLArray(forecasts))
+		goto out;
+
+	if (strtol(version, NULL, 10) != CACHE_VERSION)
+		goto out;
+
+	snprintf(number, sizeof(number), "%.4f", place->latitude);
+	if (strcmp(number, latitude) != 0)
+		goto out;
+	snprintf(number, sizeof(number), "%.4f", place->longitude);
+	if (strcmp(number, longitude) != 0)
+		goto out;
+
+	weather = newWeather(arena);
+	weather->attribution = arenaStrdup(arena, attribution);
+
+	for (i = 0; i < WMGetPropListItemCount(forecasts); i++) {
+		WMPropList *item;
+		const char *weekday, *low, *high, *forecastText;
+		Forecast *forecast;
+		int day;
+
+		item = WMGetFromPLArray(forecasts, i);
+		if (!WMIsPLDictionary(item))
+			continue;
+		weekday = getPLDictionaryString(item, "weekday");
+		low = getPLDictionaryString(item, "low");
+		high = getPLDictionaryString(item, "high");
+		forecastText = getPLDictionaryString(item, "text");
+		if (!weekday || !low || !high || !forecastText)
+			continue;
+		day = atoi(weekday);
+		if (day < 0 || day > 6)
+			continue;
+
+		forecast = appendForecast(&weather->forecasts);
+		if (!forecast)
+			break;
+		setForecast(forecast, day, atof(low), atof(high),
+			    forecastText);
 	}
 
-	text = wstrappend(text, "\n");
-	text = wstrappend(text, weather->attribution);
-	text = wstrappend(text, "\n\n");
-	return text;
-}
-
-char *getConditionsText(GWeatherInfo *info)
-{
-	char text[1024];
-
-	snprintf(text, 1024, "\n"
-		 "City:\t\t\t\t%s\n"
-		 "Last update:\t\t%s\n"
-		 "Conditions:\t\t%s\n"
-		 "Sky:\t\t\t\t%s\n"
-		 "Temperature:\t\t%s\n"
-		 "Feels like:\t\t\t%s\n"
-		 "Dew point:\t\t%s\n"
-		 "Relative humidity:\t%s\n"
-		 "Wind:\t\t\t%s\n"
-		 "Pressure:\t\t\t%s\n"
-		 "Visibility:\t\t\t%s\n"
-		 "Sunrise:\t\t\t%s\n"
-		 "Sunset:\t\t\t%s\n\n",
-		 gweather_info_get_location_name(info),
-		 gweather_info_get_update(info),
-		 gweather_info_get_conditions(info),
-		 gweather_info_get_sky(info),
-		 gweather_info_get_temp(info),
-		 gweather_info_get_apparent(info),
-		 gweather_info_get_dew(info),
-		 gweather_info_get_humidity(info),
-		 gweather_info_get_wind(info),
-		 gweather_info_get_pressure(info),
-		 gweather_info_get_visibility(info),
-		 gweather_info_get_sunrise(info),
-		 gweather_info_get_sunset(info));
-
-	return wstrdup(text);
-}
-
-char *getTemp(GWeatherInfo *info, GWeatherTemperatureUnit unit)
-{
-	double temp_double;
-	char temp[4];
-
-	gweather_info_get_value_temp(info, unit, &temp_double);
-	sprintf(temp, "%d", round(temp_double));
-	return wstrdup(temp);
-}
-
-void gather_forecasts(Weather *weather, GSList *gforecasts)
-{
-	GDateTime *d;
-	int current_weekday, high, low;
-	const char *conditions;
-
-	d = g_date_time_new_now_local();
-	current_weekday = g_date_time_get_day_of_week(d);
-	high = INT_MIN;
-	low = INT_MAX;
-	conditions = "";
-
-	for (; gforecasts; gforecasts = gforecasts->next) {
-		time_t time;
-		double temp;
-		int weekday;
-
-		if (!gweather_info_get_value_update(gforecasts->data, &time))
+	setConditions(weather, atof(temp), text, code);
+	weather->timestamp = strtoll(timestamp, NULL, 10);
+	snprintf(weather->retrieved, sizeof(weather->retrieved), "%s",
+		 retrieved);
+
+out:
+	WMReleasePropList(cache);
+	return weather;
+}
+
+/* the arena that isn't holding the weather currently on display */
+static Arena *getSpareArena(Dockapp *dockapp)
+{
+	if (dockapp->weather && dockapp->weather->arena == dockapp->arenas[0])
+		return dockapp->arenas[1];
+	return dockapp->arenas[0];
+}
+
+/* recordings are numbered in the order the updates arrived */
+char *getRecordingFilename(const char *directory, Place *place, int index)
+{
+	char name[80];
+
+	snprintf(name, sizeof(name), "%.4f,%.4f-%d.plist", place->latitude,
+		 place->longitude, index);
+	return g_build_filename(directory, name, NULL);
+}
+
+void recordProviderResult(Preferences *prefs, Place *place, int index,
+			  ProviderResult *result)
+{
+	char *filename;
+
+	filename = getRecordingFilename(prefs->recordDir, place, index);
+	if (g_mkdir_with_parents(prefs->recordDir, 0700) != 0 ||
+	    !saveProviderResult(result, filename))
+		wwarning("could not write recording %s", filename);
+	g_free(filename);
+}
+
+/* play back the recording after the one played last time, staying on the
+ * last one once they run out */
+ProviderResult *replayProviderResult(Preferences *prefs, Place *place,
+				     int *index, Arena *arena)
+{
+	ProviderResult *result;
+	char *filename;
+
+	filename = getRecordingFilename(prefs->replayDir, place, *index);
+	result = loadProviderResult(filename, arena);
+	g_free(filename);
+
+	if (result)
+		(*index)++;
+	else if (*index > 0) {
+		filename = getRecordingFilename(prefs->replayDir, place,
+						*index - 1);
+		result = loadProviderResult(filename, arena);
+		g_free(filename);
+	}
+
+	return result;
+}
+
+static void showProviderResult(Dockapp *dockapp, ProviderResult *result,
+			       Arena *arena)
+{
+	Weather *weather;
+	long long started;
+
+	started = statsNow();
+	if (result) {
+		weather = buildWeather(result, dockapp->prefs->days, arena);
+		fillHourlySeries(dockapp->hourly, result->samples,
+				 result->length, result->units);
+	} else {
+		weather = newWeather(arena);
+		setConditions(weather, 0, "", "dialog-error");
+		setError(weather, "No recording for this location");
+	}
+	recordPhase(PHASE_BUILD, started);
+	showWeather(dockapp, weather);
+
+	refreshStats.refreshes++;
+	if (weather->errorFlag)
+		refreshStats.errors++;
+	if (dockapp->fetchStarted) {
+		recordPhase(PHASE_TOTAL, dockapp->fetchStarted);
+		dockapp->fetchStarted = 0;
+	}
+
+	/* a replayed update isn't real weather */
+	if (!weather->errorFlag && !dockapp->prefs->replayDir)
+		saveWeatherCache(getPlace(dockapp), weather);
+}
+
+static void recordProviderPhase(Dockapp *dockapp)
+{
+	if (dockapp->fetchStarted)
+		recordPhase(PHASE_PROVIDER, dockapp->fetchStarted);
+}
+
+void getWeather(GWeatherInfo *info, Dockapp *dockapp)
+{
+	ProviderResult *result;
+	Arena *arena;
+	long long started;
+
+	recordProviderPhase(dockapp);
+
+	started = statsNow();
+	arena = getSpareArena(dockapp);
+	result = readProviderResult(info, dockapp->prefs->units, arena);
+	recordPhase(PHASE_READ, started);
+	if (dockapp->prefs->recordDir)
+		recordProviderResult(dockapp->prefs, getPlace(dockapp),
+				     dockapp->updates, result);
+	dockapp->updates++;
+
+	showProviderResult(dockapp, result, arena);
+}
+
+static void replayWeather(void *data)
+{
+	Dockapp *dockapp = (Dockapp *)data;
+	ProviderResult *result;
+	Arena *arena;
+	long long started;
+
+	recordProviderPhase(dockapp);
+
+	started = statsNow();
+	arena = getSpareArena(dockapp);
+	result = replayProviderResult(dockapp->prefs, getPlace(dockapp),
+				      &dockapp->updates, arena);
+	recordPhase(PHASE_READ, started);
+
+	showProviderResult(dockapp, result, arena);
+}
+
+/* text followed by the retry state */
+static char *getRetryText(Dockapp *dockapp, const char *text)
+{
+	TextBuilder builder;
+	RetryPolicy *retry = dockapp->retry;
+
+	initTextBuilder(&builder, strlen(text) + 128);
+	appendText(&builder, text);
+	if (retry->failures)
+		appendTextf(&builder, "\n\nRetry %d in %ld:%02ld "
+			    "(backoff up to %ld minutes)\n\n",
+			    retry->failures, retry->delay / 60,
+			    retry->delay % 60, dockapp->prefs->retry);
+	else
+		appendTextf(&builder, "Retry backoff:\t\tup to %ld minutes\n\n",
+			    dockapp->prefs->retry);
+
+	return finishText(&builder);
+}
+
+/* cached weather has no detailed conditions, so only the forecast is
+ * available for the balloon */
+void showBalloon(Dockapp *dockapp)
+{
+	Weather *weather = dockapp->weather;
+	char *text;
+
+	if (!weather)
+		return;
+
+	if (weather->errorFlag)
+		text = getRetryText(dockapp, weather->errorText);
+	else if (dockapp->showForecast || !weather->conditions)
+		text = getForecastText(weather, dockapp->prefs->days,
+				       dockapp->prefs->units);
+	else
+		text = getRetryText(dockapp, weather->conditions);
+
+	if (dockapp->shownBalloon && strcmp(dockapp->shownBalloon, text) == 0) {
+		wfree(text);
+		return;
+	}
+
+	refreshStats.balloonBytes += strlen(text);
+	WMSetBalloonTextForView(text, WMWidgetView(dockapp->icon));
+	if (dockapp->shownBalloon)
+		wfree(dockapp->shownBalloon);
+	dockapp->shownBalloon = text;
+}
+
+/* returns whether the label needs to be redisplayed */
+static Bool setDockappLabel(Dockapp *dockapp, const char *label)
+{
+	if (dockapp->shownLabel && strcmp(dockapp->shownLabel, label) == 0)
+		return False;
+
+	WMSetLabelText(dockapp->text, label);
+	if (dockapp->shownLabel)
+		wfree(dockapp->shownLabel);
+	dockapp->shownLabel = wstrdup(label);
+	return True;
+}
+
+/* icons come from the cache, so the same icon is the same pixmap */
+static Bool setDockappIcon(Dockapp *dockapp, WMPixmap *icon)
+{
+	if (!icon || icon == dockapp->shownIcon)
+		return False;
+
+	WMSetLabelImage(dockapp->icon, icon);
+	dockapp->shownIcon = icon;
+	return True;
+}
+
+Sparkline *newSparkline(void)
+{
+	Sparkline *sparkline = wmalloc(sizeof(Sparkline));
+	int i;
+
+	sparkline->image = RCreateImage(SPARKLINE_WIDTH, SPARKLINE_HEIGHT,
+					False);
+	sparkline->pixmap = NULL;
+	for (i = 0; i < SPARKLINE_WIDTH; i++)
+		sparkline->heights[i] = 0;
+	sparkline->stale = True;
+	return sparkline;
+}
+
+/* the image has no alpha channel, so each pixel is three bytes */
+static void drawSparklineColumn(RImage *image, int x, int height,
+				const RColor *foreground,
+				const RColor *background)
+{
+	unsigned char *pixel;
+	int y;
+
+	pixel = image->data + 3 * x;
+	for (y = 0; y < SPARKLINE_HEIGHT; y++) {
+		const RColor *color;
+
+		color = y < SPARKLINE_HEIGHT - height ? background : foreground;
+		pixel[0] = color->red;
+		pixel[1] = color->green;
+		pixel[2] = color->blue;
+		pixel += 3 * SPARKLINE_WIDTH;
+	}
+}
+
+/* scale the hourly series from the current hour onwards to column
+ * heights; returns whether the graph needs to be redisplayed */
+static Bool updateSparkline(Dockapp *dockapp)
+{
+	Sparkline *sparkline = dockapp->sparkline;
+	float values[SPARKLINE_WIDTH];
+	float low, high;
+	time_t start;
+	Bool changed;
+	int x;
+
+	start = time(NULL);
+	start -= start % 3600;
+	getHourlyColumns(dockapp->hourly, start, SPARKLINE_HOURS * 3600,
+			 SPARKLINE_WIDTH, values);
+
+	low = INFINITY;
+	high = -INFINITY;
+	for (x = 0; x < SPARKLINE_WIDTH; x++) {
+		if (isnan(values[x]))
 			continue;
+		if (values[x] < low)
+			low = values[x];
+		if (values[x] > high)
+			high = values[x];
+	}
 
-		d = g_date_time_new_from_unix_utc(time);
-		if (!d)
+	changed = False;
+	for (x = 0; x < SPARKLINE_WIDTH; x++) {
+		int height;
+
+		if (isnan(values[x]))
+			height = 0;
+		else if (high > low)
+			height = 1 + lround((values[x] - low) / (high - low) *
+					    (SPARKLINE_HEIGHT - 2));
+		else
+			height = SPARKLINE_HEIGHT / 2;
+
+		if (!sparkline->stale && height == sparkline->heights[x])
 			continue;
+		drawSparklineColumn(sparkline->image, x, height,
+				    &dockapp->palette->rtext,
+				    &dockapp->palette->rbackground);
+		sparkline->heights[x] = height;
+		changed = True;
+	}
+	sparkline->stale = False;
+
+	if (!changed)
+		return False;
+
+	if (sparkline->pixmap)
+		WMReleasePixmap(sparkline->pixmap);
+	sparkline->pixmap = WMCreatePixmapFromRImage(dockapp->screen,
+						     sparkline->image, 0);
+	WMSetLabelImage(dockapp->graph, sparkline->pixmap);
+	return True;
+}
 
-		weekday = g_date_time_get_day_of_week(d);
-
-		/* follow gnome weather's convention of using 2 pm for
-		 * conditions */
-		if (g_date_time_get_hour(d) >= 14 &&
-		    strcmp(conditions, "") == 0) {
-			conditions = gweather_info_get_conditions(
-				gforecasts->data);
-			if (strcmp(conditions, "-") == 0)
-				conditions = gweather_info_get_sky(
-					gforecasts->data);
+/* the icon for the weather, or the error icon if there is an error; a
+ * missing icon is an error too */
+static WMPixmap *getWeatherIcon(Dockapp *dockapp, Weather *weather)
+{
+	WMPixmap *icon;
+
+	icon = NULL;
+	if (!weather->errorFlag) {
+		icon = getIcon(dockapp->icons, dockapp->screen,
+			       dockapp->prefs->icondir,
+			       dockapp->palette, weather->code);
+		if (!icon) {
+			char *filename, *errorText;
+
+			filename = getIconFilename(
+				dockapp->prefs->icondir,
+				icon_names[getIconSlot(weather->code)]);
+			errorText = wstrconcat(filename, " not found");
+			setError(weather, errorText);
+			wfree(errorText);
+			wfree(filename);
 		}
+	}
+
+	if (weather->errorFlag)
+		icon = getIcon(dockapp->icons, dockapp->screen,
+			       dockapp->prefs->icondir,
+			       dockapp->palette, "dialog-error");
+	return icon;
+}
 
-		if (weekday != current_weekday) {
-			/* don't create forecast if we don't have any info
-			 * (e.g., for today if it's almost midnight) */
-			if (high != INT_MIN && low != INT_MAX) {
-				Forecast *forecast;
-				char high_text[12], low_text[12];
-				char *day_name;
+/* put the dockapp's weather on screen in the current units, redisplaying
+ * only the widgets that changed */
+static void drawWeather(Dockapp *dockapp, WMPixmap *icon)
+{
+	Weather *weather = dockapp->weather;
+	Bool labelChanged, iconChanged, graphChanged;
 
-				forecast = newForecast();
+	iconChanged = setDockappIcon(dockapp, icon);
+	graphChanged = dockapp->graph && updateSparkline(dockapp);
+	if (weather->errorFlag)
+		labelChanged = setDockappLabel(dockapp, "ERROR");
+	else {
+		char label[16];
 
-				/* subtract one since we've already advanced to
-				 * the next day */
-				day_name = g_date_time_format(
-					g_date_time_add_days(d, -1), "%a");
+		snprintf(label, sizeof(label), "%d°",
+			 displayTemp(weather->temp, dockapp->prefs->units));
+		labelChanged = setDockappLabel(dockapp, label);
+	}
 
-				snprintf(high_text, 12, "%d", high);
-				snprintf(low_text, 12, "%d", low);
+	showBalloon(dockapp);
 
-				setForecast(forecast, day_name, low_text,
-					    high_text, conditions);
-				appendForecast(weather->forecasts, forecast);
-			}
+	if (iconChanged)
+		WMRedisplayWidget(dockapp->icon);
+	if (labelChanged)
+		WMRedisplayWidget(dockapp->text);
+	if (graphChanged)
+		WMRedisplayWidget(dockapp->graph);
+}
 
-			current_weekday = weekday;
-			high = INT_MIN;
-			low = INT_MAX;
-			conditions = "";
-		}
-		gweather_info_get_value_temp(gforecasts->data,
-					     weather->units, &temp);
-		if (temp > high)
-			high = round(temp);
-		if (temp < low)
-			low = round(temp);
-		g_date_time_unref(d);
+/* the dockapp takes ownership of weather, which is kept until the next
+ * refresh replaces it */
+void showWeather(Dockapp *dockapp, Weather *weather)
+{
+	WMPixmap *icon;
+	long long started;
+
+	if (dockapp->weather)
+		freeWeather(dockapp->weather);
+	dockapp->weather = weather;
+
+	started = statsNow();
+	icon = getWeatherIcon(dockapp, weather);
+	recordPhase(PHASE_ICON, started);
+
+	/* the balloon shows the retry, so schedule it before drawing */
+	if (weather->errorFlag) {
+		refreshStats.retries++;
+		scheduleDockapp(dockapp,
+				nextRetryDelay(dockapp->retry,
+					       dockapp->prefs->retry * 60));
+	} else
+		resetRetryPolicy(dockapp->retry);
+
+	started = statsNow();
+	drawWeather(dockapp, icon);
+	recordPhase(PHASE_DRAW, started);
+}
+
+/* draw the weather we already have again, e.g. after the units or colors
+ * change, without going back to the provider */
+static void redrawWeather(Dockapp *dockapp)
+{
+	if (dockapp->weather)
+		drawWeather(dockapp,
+			    getWeatherIcon(dockapp, dockapp->weather));
+}
+
+Palette *newPalette(void)
+{
+	Palette *palette = wmalloc(sizeof(Palette));
+	palette->backgroundName = NULL;
+	palette->textName = NULL;
+	palette->background = NULL;
+	palette->text = NULL;
+	return palette;
+}
+
+/* look up a color by name, falling back to the given default (and
+ * updating the preference to match) if the name isn't valid */
+static WMColor *createPaletteColor(WMScreen *screen, const char **name,
+				   const char *fallback)
+{
+	WMColor *color;
+
+	color = WMCreateNamedColor(screen, *name, True);
+	if (!color) {
+		color = WMCreateNamedColor(screen, fallback, True);
+		*name = fallback;
 	}
+
+	return color;
 }
 
-/* strip html from attribution string */
-char *strip_tags(const char *to_strip)
+/* resolve the configured colors; this only talks to the X server when
+ * the preferences name different colors than last time */
+void setPalette(Palette *palette, WMScreen *screen, Preferences *prefs)
 {
-	char *stripped, *beginning, *end;
+	if (!palette->backgroundName ||
+	    strcmp(palette->backgroundName, prefs->background) != 0) {
+		if (palette->background)
+			WMReleaseColor(palette->background);
+		palette->background = createPaletteColor(
+			screen, &prefs->background, DEFAULT_BG_COLOR);
+		palette->rbackground = WMGetRColorFromColor(
+			palette->background);
+		wfree(palette->backgroundName);
+		palette->backgroundName = wstrdup(prefs->background);
+	}
 
-	if (!to_strip)
-		return wstrdup("");
+	if (!palette->textName ||
+	    strcmp(palette->textName, prefs->text) != 0) {
+		if (palette->text)
+			WMReleaseColor(palette->text);
+		palette->text = createPaletteColor(
+			screen, &prefs->text, DEFAULT_TEXT_COLOR);
+		palette->rtext = WMGetRColorFromColor(palette->text);
+		wfree(palette->textName);
+		palette->textName = wstrdup(prefs->text);
+	}
+}
 
-	stripped = wstrdup(to_strip);
-	while ((beginning = strchr(stripped, '<')) &&
-	       (end = strchr(stripped, '>'))) {
-		int length;
+IconCache *newIconCache(void)
+{
+	IconCache *cache = wmalloc(sizeof(IconCache));
+	int i;
 
-		length = end - beginning + 1;
-		memmove(stripped + length, stripped, beginning - stripped);
-		stripped += length;
+	cache->icondir = NULL;
+	cache->background = NULL;
+	for (i = 0; i < NUM_ICONS; i++)
+		cache->pixmaps[i] = NULL;
+	return cache;
+}
+
+void clearIconCache(IconCache *cache)
+{
+	int i;
+
+	for (i = 0; i < NUM_ICONS; i++) {
+		if (cache->pixmaps[i])
+			WMReleasePixmap(cache->pixmaps[i]);
+		cache->pixmaps[i] = NULL;
+	}
+	wfree(cache->icondir);
+	cache->icondir = NULL;
+	wfree(cache->background);
+	cache->background = NULL;
+}
+
+/* decode an icon and composite it onto the background once */
+static WMPixmap *loadCachedIcon(WMScreen *screen, const char *icondir,
+				Palette *palette, IconSlot slot)
+{
+	WMPixmap *pixmap;
+	RImage *image;
+	char *filename;
+
+	filename = getIconFilename(icondir, icon_names[slot]);
+	image = RLoadImage(WMScreenRContext(screen), filename, 0);
+	wfree(filename);
+
+	pixmap = NULL;
+	if (image) {
+		RCombineImageWithColor(image, &palette->rbackground);
+		pixmap = WMCreatePixmapFromRImage(screen, image, 0);
+		RReleaseImage(image);
 	}
 
-	return stripped;
+	return pixmap;
 }
 
-void getWeather(GWeatherInfo *info, Dockapp *dockapp)
+/* returns the icon for the given code from the cache, or NULL if the
+ * icon directory's file for its slot couldn't be loaded.  the cache is
+ * rebuilt whenever the icon directory or background color changes. */
+WMPixmap *getIcon(IconCache *cache, WMScreen *screen, const char *icondir,
+		  Palette *palette, const char *code)
 {
-	char *temp, *text;
-	const char *code;
-	WMPixmap *icon;
+	int i;
+
+	if (!cache->icondir || strcmp(cache->icondir, icondir) != 0 ||
+	    strcmp(cache->background, palette->backgroundName) != 0) {
+		clearIconCache(cache);
+		cache->icondir = wstrdup(icondir);
+		cache->background = wstrdup(palette->backgroundName);
+		for (i = 0; i < NUM_ICONS; i++)
+			cache->pixmaps[i] = loadCachedIcon(screen, icondir,
+							   palette, i);
+	}
+
+	return cache->pixmaps[getIconSlot(code)];
+}
+
+static void setCityPoint(CityPoint *point, double latitude, double longitude)
+{
+	double phi, lambda;
+
+	phi = latitude * M_PI / 180;
+	lambda = longitude * M_PI / 180;
+	point->x = cos(phi) * cos(lambda);
+	point->y = cos(phi) * sin(lambda);
+	point->z = sin(phi);
+}
+
+static double cityPointAxis(const CityPoint *point, int axis)
+{
+	switch (axis) {
+	case 0:
+		return point->x;
+	case 1:
+		return point->y;
+	default:
+		return point->z;
+	}
+}
+
+static double cityPointDistance(const CityPoint *a, const CityPoint *b)
+{
+	return (a->x - b->x) * (a->x - b->x) +
+		(a->y - b->y) * (a->y - b->y) +
+		(a->z - b->z) * (a->z - b->z);
+}
+
+static void appendCity(CityIndex *index, GWeatherLocation *loc)
+{
+	double latitude, longitude;
+
+	if (index->length == index->capacity) {
+		index->capacity = index->capacity ? 2 * index->capacity : 1024;
+		index->points = wrealloc(index->points,
+					 index->capacity * sizeof(CityPoint));
+	}
+
+	gweather_location_get_coords(loc, &latitude, &longitude);
+	setCityPoint(&index->points[index->length], latitude, longitude);
+#if HAVE_GWEATHER_VERSION >= 4000000
+	index->points[index->length].location = g_object_ref(loc);
+#else
+	index->points[index->length].location = gweather_location_ref(loc);
+#endif
+	index->length++;
+}
+
+static void collectCities(CityIndex *index, GWeatherLocation *loc)
+{
+	if (gweather_location_get_level(loc) == GWEATHER_LOCATION_CITY) {
+		if (gweather_location_has_coords(loc))
+			appendCity(index, loc);
+		return;
+	}
+
+#if HAVE_GWEATHER_VERSION >= 3040000
+	{
+		GWeatherLocation *child = NULL;
+
+		while ((child = gweather_location_next_child(loc, child)))
+			collectCities(index, child);
+	}
+#else
+	{
+		GWeatherLocation **children;
+		int i;
+
+		children = gweather_location_get_children(loc);
+		for (i = 0; children[i]; i++)
+			collectCities(index, children[i]);
+	}
+#endif
+}
+
+static int sortAxis;
+
+static int compareCityPoints(const void *a, const void *b)
+{
+	double difference;
+
+	difference = cityPointAxis(a, sortAxis) - cityPointAxis(b, sortAxis);
+	return (difference > 0) - (difference < 0);
+}
+
+/* put the median along the current axis in the middle of the range, with
+ * the smaller half before it and the larger half after it */
+static void buildCityTree(CityPoint *points, int length, int depth)
+{
+	int median;
+
+	if (length <= 1)
+		return;
+
+	sortAxis = depth % 3;
+	qsort(points, length, sizeof(CityPoint), compareCityPoints);
+
+	median = length / 2;
+	buildCityTree(points, median, depth + 1);
+	buildCityTree(points + median + 1, length - median - 1, depth + 1);
+}
+
+static void searchCityTree(CityPoint *points, int length, int depth,
+			   const CityPoint *target, CityPoint **best,
+			   double *bestDistance)
+{
+	int median, axis;
+	double distance, difference;
+
+	if (length <= 0)
+		return;
+
+	median = length / 2;
+	axis = depth % 3;
+
+	distance = cityPointDistance(&points[median], target);
+	if (distance < *bestDistance) {
+		*bestDistance = distance;
+		*best = &points[median];
+	}
+
+	difference = cityPointAxis(target, axis) -
+		cityPointAxis(&points[median], axis);
+
+	if (difference < 0) {
+		searchCityTree(points, median, depth + 1, target, best,
+			       bestDistance);
+		if (difference * difference < *bestDistance)
+			searchCityTree(points + median + 1, length - median - 1,
+				       depth + 1, target, best, bestDistance);
+	} else {
+		searchCityTree(points + median + 1, length - median - 1,
+			       depth + 1, target, best, bestDistance);
+		if (difference * difference < *bestDistance)
+			searchCityTree(points, median, depth + 1, target, best,
+				       bestDistance);
+	}
+}
+
+/* walk the world database once and keep every city for later lookups */
+CityIndex *getCityIndex(void)
+{
+	static CityIndex *index = NULL;
+
+	if (!index) {
+		index = wmalloc(sizeof(CityIndex));
+		index->length = 0;
+		index->capacity = 0;
+		index->points = NULL;
+
+		collectCities(index, gweather_location_get_world());
+		buildCityTree(index->points, index->length, 0);
+	}
+
+	return index;
+}
+
+/* returns a new reference to the city closest to the given coordinates */
+GWeatherLocation *findNearestCity(double latitude, double longitude)
+{
+	CityIndex *index;
+	CityPoint target, *best;
+	double bestDistance;
+
+	index = getCityIndex();
+	if (index->length == 0)
+		return gweather_location_find_nearest_city(
+			gweather_location_get_world(), latitude, longitude);
+
+	setCityPoint(&target, latitude, longitude);
+	best = NULL;
+	bestDistance = INFINITY;
+	searchCityTree(index->points, index->length, 0, &target, &best,
+		       &bestDistance);
+
+#if HAVE_GWEATHER_VERSION >= 4000000
+	return g_object_ref(best->location);
+#else
+	return gweather_location_ref(best->location);
+#endif
+}
+
+/* the location only needs to be looked up again when the coordinates
+ * change */
+GWeatherLocation *getLocation(Place *place)
+{
+	if (place->location && place->locationLatitude == place->latitude &&
+	    place->locationLongitude == place->longitude)
+		return place->location;
+
+	if (place->location)
+#if HAVE_GWEATHER_VERSION >= 4000000
+		g_object_unref(place->location);
+#else
+		gweather_location_unref(place->location);
+#endif
+
+	place->location = findNearestCity(place->latitude, place->longitude);
+	place->locationLatitude = place->latitude;
+	place->locationLongitude = place->longitude;
+
+	return place->location;
+}
+
+WeatherSession *newWeatherSession(void)
+{
+	WeatherSession *session = wmalloc(sizeof(WeatherSession));
+	session->info = NULL;
+	session->updatedHandler = 0;
+	session->latitude = 0;
+	session->longitude = 0;
+	return session;
+}
+
+/* drop the current GWeatherInfo and its "updated" handler so that the
+ * next refresh builds a new one */
+void clearWeatherSession(WeatherSession *session)
+{
+	if (!session->info)
+		return;
+
+	if (session->updatedHandler)
+		g_signal_handler_disconnect(session->info,
+					    session->updatedHandler);
+	g_object_unref(session->info);
+	session->info = NULL;
+	session->updatedHandler = 0;
+}
+
+GWeatherInfo *newWeatherInfo(GWeatherLocation *location)
+{
+	GWeatherInfo *info;
+
+#if HAVE_GWEATHER_VERSION >= 3027004
+	info = gweather_info_new(NULL);
+#else
+	info = gweather_info_new(NULL, GWEATHER_FORECAST_LIST);
+#endif
+#if HAVE_GWEATHER_VERSION >= 3040000
+	gweather_info_set_application_id(info, APPLICATION_ID);
+	gweather_info_set_contact_info(info, CONTACT_INFO);
+#endif
+	gweather_info_set_location(info, location);
+	gweather_info_set_enabled_providers(info, GWEATHER_PROVIDER_ALL);
+
+	return info;
+}
+
+/* create the GWeatherInfo for the current location once and reuse it for
+ * every refresh; it is only rebuilt when the coordinates change */
+static GWeatherInfo *getSessionInfo(Dockapp *dockapp)
+{
+	WeatherSession *session = dockapp->session;
+	Place *place = getPlace(dockapp);
+	long long started;
+
+	if (session->info && session->latitude == place->latitude &&
+	    session->longitude == place->longitude)
+		return session->info;
+
+	clearWeatherSession(session);
+
+	started = statsNow();
+	session->info = newWeatherInfo(getLocation(place));
+	recordPhase(PHASE_LOCATION, started);
+	session->updatedHandler = g_signal_connect(
+		G_OBJECT(session->info), "updated", G_CALLBACK(getWeather),
+		dockapp);
+	session->latitude = place->latitude;
+	session->longitude = place->longitude;
+
+	return session->info;
+}
+
+static void fetchWeather(Dockapp *dockapp)
+{
+	dockapp->fetchStarted = statsNow();
+
+	if (dockapp->prefs->replayDir) {
+		/* still finish asynchronously, like a real update */
+		WMAddTimerHandler(0, replayWeather, dockapp);
+		return;
+	}
+
+	gweather_info_update(getSessionInfo(dockapp));
+	/* sources added outside of a glib dispatch don't wake up the
+	 * context on their own */
+	g_main_context_wakeup(NULL);
+}
+
+static void showLoading(Dockapp *dockapp)
+{
+	if (setDockappLabel(dockapp, "loading"))
+		WMRedisplayWidget(dockapp->text);
+}
+
+/* the current weather stays up while a routine refresh is in flight */
+static void updateDockapp(void *data)
+{
+	Dockapp *dockapp = (Dockapp *)data;
+
+	if (!dockapp->weather)
+		showLoading(dockapp);
+
+	fetchWeather(dockapp);
+}
+
+/* redraw everything in the current palette */
+static void applyPalette(Dockapp *dockapp)
+{
+	WMColor *background;
+	WMColor *text;
+
+	background = dockapp->palette->background;
+	text = dockapp->palette->text;
+
+	WMSetWidgetBackgroundColor(dockapp->text, background);
+	WMSetLabelTextColor(dockapp->text, text);
+	WMSetWidgetBackgroundColor(dockapp->frame, background);
+	WMSetWidgetBackgroundColor(dockapp->icon, background);
+	WMRedisplayWidget(dockapp->text);
+
+	/* the icons are composited onto the old background */
+	dockapp->shownIcon = NULL;
+
+	if (dockapp->graph) {
+		WMSetWidgetBackgroundColor(dockapp->graph, background);
+		dockapp->sparkline->stale = True;
+	}
+}
+
+/* show the cached weather right away; only go to the network if it is
+ * older than the refresh interval */
+static void startDockapp(Dockapp *dockapp)
+{
+	Preferences *prefs = dockapp->prefs;
 	Weather *weather;
-	GSList *gforecasts;
-	gboolean success;
-	gdouble dummy;
-
-	weather = newWeather();
-	weather->units = dockapp->prefs->units;
-
-	if (!gweather_info_is_valid(info))
-		setError(weather,
-			 gweather_info_get_weather_summary(info));
-
-	weather->attribution = strip_tags(gweather_info_get_attribution(info));
-
-	gforecasts = gweather_info_get_forecast_list(info);
-	if (gforecasts)
-		gather_forecasts(weather, gforecasts);
-
-	/* check if we have current conditions */
-	success = gweather_info_get_value_temp(info, dockapp->prefs->units,
-					       &dummy);
-	if (!success) {
-		/* if we don't, get the next forecasted conditions */
-		gforecasts = gweather_info_get_forecast_list(info);
-
-		if (!gforecasts)
-			setError(weather, "Retrieval failed");
-		else {
-			while (!success) {
-				success = gweather_info_get_value_temp(
-					gforecasts->data, dockapp->prefs->units,
-					&dummy);
-				if (success) {
-					info = gforecasts->data;
-					break;
-				}
+	long int age;
+
+	weather = NULL;
+	if (!prefs->replayDir)
+		weather = loadWeatherCache(getPlace(dockapp),
+					   dockapp->arenas[0]);
+	if (!weather) {
+		scheduleDockapp(dockapp, getRefreshSeconds(prefs));
+		updateDockapp(dockapp);
+		return;
+	}
+
+	age = time(NULL) - weather->timestamp;
+	showWeather(dockapp, weather);
+
+	if (!weather->errorFlag && age >= 0 && age < getRefreshSeconds(prefs)) {
+		scheduleDockapp(dockapp, getRefreshSeconds(prefs) - age);
+	} else {
+		scheduleDockapp(dockapp, getRefreshSeconds(prefs));
+		fetchWeather(dockapp);
+	}
+}
+
+void printJsonString(FILE *stream, const char *text)
+{
+	const unsigned char *c;
+
+	if (!text) {
+		fputs("null", stream);
+		return;
+	}
+
+	fputc('"', stream);
+	for (c = (const unsigned char *)text; *c; c++) {
+		switch (*c) {
+		case '"':
+			fputs("\\\"", stream);
+			break;
+		case '\\':
+			fputs("\\\\", stream);
+			break;
+		case '\n':
+			fputs("\\n", stream);
+			break;
+		case '\t':
+			fputs("\\t", stream);
+			break;
+		default:
+			if (*c < 0x20)
+				fprintf(stream, "\\u%04x", *c);
+			else
+				fputc(*c, stream);
+		}
+	}
+	fputc('"', stream);
+}
+
+void printWeatherJson(FILE *stream, Place *place, Weather *weather, int days,
+		      GWeatherTemperatureUnit units)
+{
+	int i;
+
+	fprintf(stream, "  {\n    \"latitude\": %.4f,\n", place->latitude);
+	fprintf(stream, "    \"longitude\": %.4f,\n", place->longitude);
+	fputs("    \"units\": ", stream);
+	printJsonString(stream,
+			units == GWEATHER_TEMP_UNIT_CENTIGRADE ? "c" : "f");
+	fputs(",\n    \"error\": ", stream);
+	printJsonString(stream, weather->errorFlag ? weather->errorText : NULL);
+	fputs(",\n    \"retrieved\": ", stream);
+	printJsonString(stream, weather->retrieved);
+	fprintf(stream, ",\n    \"timestamp\": %ld,\n",
+		(long)weather->timestamp);
+	if (!weather->errorFlag)
+		fprintf(stream, "    \"temperature\": %d,\n",
+			displayTemp(weather->temp, units));
+	else
+		fputs("    \"temperature\": null,\n", stream);
+	fputs("    \"summary\": ", stream);
+	printJsonString(stream, weather->text);
+	fputs(",\n    \"icon\": ", stream);
+	printJsonString(stream, weather->code);
+	fputs(",\n    \"attribution\": ", stream);
+	printJsonString(stream, weather->attribution);
+	fputs(",\n    \"forecast\": [", stream);
+
+	for (i = 0; i < weather->forecasts.length && i < days; i++) {
+		Forecast *forecast = &weather->forecasts.forecasts[i];
+
+		fputs(i ? ",\n      {\"day\": " : "\n      {\"day\": ", stream);
+		printJsonString(stream, getWeekdayName(forecast->weekday));
+		fprintf(stream, ", \"low\": %d, \"high\": %d, \"text\": ",
+			displayTemp(forecast->low, units),
+			displayTemp(forecast->high, units));
+		printJsonString(stream, forecast->text);
+		fputc('}', stream);
+	}
+
+	fputs(i ? "\n    ]\n  }" : "]\n  }", stream);
+}
+
+static void dumpUpdated(GWeatherInfo *info, DumpJob *job)
+{
+	ProviderResult *result;
+
+	/* only the first result counts */
+	if (job->weather)
+		return;
+
+	result = readProviderResult(info, job->prefs->units, job->arena);
+	if (job->prefs->recordDir)
+		recordProviderResult(job->prefs, job->place, 0, result);
+	job->weather = buildWeather(result, job->prefs->days, job->arena);
+	if (--*job->pending == 0)
+		g_main_loop_quit(job->loop);
+}
 
-				gforecasts = gforecasts->next;
-				if (!gforecasts) {
-					setError(weather, "Retrieval failed");
-					break;
-				}
+/* fetch every location at once without touching X, print the results as
+ * a json array in the order the locations were given and return the exit
+ * status */
+int dumpWeather(Preferences *prefs)
+{
+	DumpJob *jobs;
+	GMainLoop *loop;
+	Arena *arena;
+	int i, pending, status;
+
+	jobs = wmalloc(prefs->numPlaces * sizeof(DumpJob));
+	loop = g_main_loop_new(NULL, FALSE);
+	arena = newArena();
+	pending = prefs->numPlaces;
+
+	for (i = 0; i < prefs->numPlaces; i++) {
+		DumpJob *job = &jobs[i];
+
+		job->prefs = prefs;
+		job->place = &prefs->places[i];
+		job->arena = arena;
+		job->weather = NULL;
+		job->pending = &pending;
+		job->loop = loop;
+		job->info = NULL;
+
+		if (prefs->replayDir) {
+			ProviderResult *result;
+			int index = 0;
+
+			result = replayProviderResult(prefs, job->place,
+						      &index, arena);
+			if (result) {
+				job->weather = buildWeather(
+					result, prefs->days, arena);
+			} else {
+				job->weather = newWeather(arena);
+				setConditions(job->weather, 0, "",
+					      "dialog-error");
+				setError(job->weather,
+					 "No recording for this location");
 			}
+			pending--;
+			continue;
 		}
+
+		job->info = newWeatherInfo(getLocation(job->place));
+		g_signal_connect(G_OBJECT(job->info), "updated",
+				 G_CALLBACK(dumpUpdated), job);
+		gweather_info_update(job->info);
 	}
 
-	temp = getTemp(info, dockapp->prefs->units);
-	text = gweather_info_get_weather_summary(info);
-	code = gweather_info_get_icon_name(info);
+	if (pending > 0)
+		g_main_loop_run(loop);
+
+	status = EXIT_SUCCESS;
+	fputs("[\n", stdout);
+	for (i = 0; i < prefs->numPlaces; i++) {
+		if (i)
+			fputs(",\n", stdout);
+		printWeatherJson(stdout, jobs[i].place, jobs[i].weather,
+				 prefs->days, prefs->units);
+		if (jobs[i].weather->errorFlag)
+			status = EXIT_FAILURE;
+		if (jobs[i].info)
+			g_object_unref(jobs[i].info);
+	}
+	fputs("\n]\n", stdout);
 
-	setConditions(weather, dockapp->screen, temp, text, code,
-		      dockapp->prefs->background, dockapp->prefs->icondir);
+	freeArena(arena);
+	g_main_loop_unref(loop);
+	wfree(jobs);
 
-	if (weather->errorFlag) {
-		RContext *context;
-
-		WMSetLabelText(dockapp->text, "ERROR");
-
-		context = WMScreenRContext(dockapp->screen);
-		weather->icon = RLoadImage(
-			context, wstrconcat(dockapp->prefs->icondir,
-					    "/dialog-error.png"), 0);
-		if (weather->icon) {
-			RColor color;
-
-			color = WMGetRColorFromColor(
-				WMCreateNamedColor(dockapp->screen,
-						   dockapp->prefs->background,
-						   True));
-			RCombineImageWithColor(weather->icon, &color);
-			icon = WMCreatePixmapFromRImage(
-				dockapp->screen, weather->icon, 0);
-			WMSetLabelImage(dockapp->icon, icon);
-		}
+	return status;
+}
 
-		WMSetBalloonTextForView(weather->errorText,
-					WMWidgetView(dockapp->icon));
+GWeatherTemperatureUnit string_to_unit(char *unit_string)
+{
+	if (strcmp(unit_string, "c") == 0)
+		return GWEATHER_TEMP_UNIT_CENTIGRADE;
 
-		/* try again in 1 minute */
-		dockapp->minutesLeft = 1;
-	} else {
-		WMSetLabelText(dockapp->text, wstrconcat(weather->temp, "°"));
+	else /* default to fahrenheit */
+		return GWEATHER_TEMP_UNIT_FAHRENHEIT;
+}
 
-		icon = WMCreatePixmapFromRImage(dockapp->screen,
-						weather->icon, 0);
-		WMSetLabelImage(dockapp->icon, icon);
+DisplayMode string_to_mode(const char *mode_string)
+{
+	if (strcmp(mode_string, "graph") == 0)
+		return MODE_GRAPH;
 
-		if (dockapp->showForecast)
-			WMSetBalloonTextForView(
-				getForecastText(weather, dockapp->prefs->days),
-				WMWidgetView(dockapp->icon));
-		else
-			WMSetBalloonTextForView(
-				getConditionsText(info),
-				WMWidgetView(dockapp->icon));
-	}
+	else /* default to just the icon */
+		return MODE_ICON;
+}
 
-	WMRedisplayWidget(dockapp->icon);
-	WMRedisplayWidget(dockapp->text);
+/* minutes between refreshes; anything below one minute (including text
+ * that isn't a number) would refresh in a tight loop */
+long int parseInterval(const char *text)
+{
+	long int interval = strtol(text, NULL, 10);
 
-	freeWeather(weather);
+	if (interval < 1) {
+		wwarning("refresh interval %s is too short, using 1 minute",
+			 text);
+		interval = 1;
+	}
+
+	return interval;
 }
 
-static void updateDockapp(void *data)
+/* the refresh interval in seconds, never less than a minute */
+long int getRefreshSeconds(Preferences *prefs)
 {
-	Dockapp *dockapp = (Dockapp *)data;
-	WMColor *background;
-	WMColor *text;
-	WMScreen *screen = dockapp->screen;
-	Preferences *prefs = dockapp->prefs;
-	GWeatherLocation *world, *loc;
-	GWeatherInfo *info;
-
-	background = WMCreateNamedColor(screen, prefs->background, True);
-	text = WMCreateNamedColor(screen, prefs->text, True);
+	return (prefs->interval < 1 ? 1 : prefs->interval) * 60;
+}
 
-	WMSetLabelText(dockapp->text, "loading");
-	WMSetWidgetBackgroundColor(dockapp->text, background);
-	WMSetLabelTextColor(dockapp->text, text);
-	WMRedisplayWidget(dockapp->text);
+/* coordinates given as "latitude,longitude" */
+Bool parsePlace(const char *text, double *latitude, double *longitude)
+{
+	char *end;
+
+	*latitude = strtod(text, &end);
+	if (end == text || *end != ',')
+		return False;
+	text = end + 1;
+	*longitude = strtod(text, &end);
+	return end != text && *end == '\0';
+}
 
-	WMSetWidgetBackgroundColor(dockapp->frame, background);
-	WMSetWidgetBackgroundColor(dockapp->icon, background);
+/* the nearest city is looked up again the next time it is needed */
+void setPlace(Place *place, double latitude, double longitude)
+{
+	place->latitude = latitude;
+	place->longitude = longitude;
+}
 
-	world = gweather_location_get_world();
-	loc = gweather_location_find_nearest_city(
-		world, prefs->latitude, prefs->longitude);
-#if HAVE_GWEATHER_VERSION >= 3027004
-	info = gweather_info_new(NULL);
-#else
-	info = gweather_info_new(NULL, GWEATHER_FORECAST_LIST);
-#endif
-#if HAVE_GWEATHER_VERSION >= 3040000
-	gweather_info_set_application_id(info, APPLICATION_ID);
-	gweather_info_set_contact_info(info, CONTACT_INFO);
-#endif
-	gweather_info_set_location(info, loc);
-	gweather_info_set_enabled_providers(info, GWEATHER_PROVIDER_ALL);
-	g_signal_connect(
-		G_OBJECT(info), "updated", G_CALLBACK(getWeather), dockapp);
-	gweather_info_update(info);
-}
-
-Bool check_icondir(char *icondir)
-{
-	int i, good;
-	const char icon_names[10][30] = {
-		"/dialog-error.png",
-		"/weather-clear-night.png",
-		"/weather-clear.png",
-		"/weather-few-clouds-night.png",
-		"/weather-few-clouds.png",
-		"/weather-fog.png",
-		"/weather-overcast.png",
-		"/weather-showers.png",
-		"/weather-snow.png",
-		"/weather-storm.png"
-	};
-
-	good = True;
-
-	for (i = 0; i < 10; i++) {
-		char *filename;
-
-		filename = wstrconcat(icondir, icon_names[i]);
-		if (access(filename, F_OK) != 0) {
-			good = False;
-			break;
-		}
-	}
+void addPlace(Preferences *prefs, double latitude, double longitude)
+{
+	Place *place;
 
-	return good;
+	prefs->places = wrealloc(prefs->places,
+				 (prefs->numPlaces + 1) * sizeof(Place));
+	place = &prefs->places[prefs->numPlaces++];
+	place->location = NULL;
+	setPlace(place, latitude, longitude);
 }
 
-GWeatherTemperatureUnit string_to_unit(char *unit_string)
+/* drop every place from numPlaces on, along with its nearest city */
+void truncatePlaces(Preferences *prefs, int numPlaces)
 {
-	if (strcmp(unit_string, "c") == 0)
-		return GWEATHER_TEMP_UNIT_CENTIGRADE;
+	int i;
 
-	else /* default to fahrenheit */
-		return GWEATHER_TEMP_UNIT_FAHRENHEIT;
+	for (i = numPlaces; i < prefs->numPlaces; i++) {
+		if (!prefs->places[i].location)
+			continue;
+#if HAVE_GWEATHER_VERSION >= 4000000
+		g_object_unref(prefs->places[i].location);
+#else
+		gweather_location_unref(prefs->places[i].location);
+#endif
+	}
+	if (numPlaces < prefs->numPlaces)
+		prefs->numPlaces = numPlaces;
 }
 
 void readPreferences(Preferences *prefs)
 {
 	if (prefs->defaults) {
 		char *value;
+		WMPropList *locations;
+
 		value = WMGetUDStringForKey(prefs->defaults, "units");
 		if (value)
 			prefs->units = string_to_unit(value);
 		value = WMGetUDStringForKey(prefs->defaults, "interval");
 		if (value)
-			prefs->interval = strtol(value, NULL, 10);
+			prefs->interval = parseInterval(value);
+		value = WMGetUDStringForKey(prefs->defaults, "retry");
+		if (value)
+			prefs->retry = strtol(value, NULL, 10);
 		value = WMGetUDStringForKey(prefs->defaults, "background");
 		if (value)
 			prefs->background = value;
 		value = WMGetUDStringForKey(prefs->defaults, "text");
 		if (value)
 			prefs->text = value;
+
 		value = WMGetUDStringForKey(prefs->defaults, "latitude");
 		if (value)
-			prefs->latitude = atof(value);
+			setPlace(&prefs->places[0], atof(value),
+				 prefs->places[0].longitude);
 		value = WMGetUDStringForKey(prefs->defaults, "longitude");
 		if (value)
-			prefs->longitude = atof(value);
+			setPlace(&prefs->places[0], prefs->places[0].latitude,
+				 atof(value));
+		locations = WMGetUDObjectForKey(prefs->defaults, "locations");
+		if (locations && WMIsPLArray(locations) &&
+		    !prefs->placesFromCommandLine) {
+			int i;
+
+			for (i = 0; i < WMGetPropListItemCount(locations); i++) {
+				WMPropList *location;
+				double latitude, longitude;
+
+				location = WMGetFromPLArray(locations, i);
+				if (!WMIsPLString(location) ||
+				    !parsePlace(WMGetFromPLString(location),
+						&latitude, &longitude)) {
+					wwarning("ignoring invalid location");
+					continue;
+				}
+				if (i + 1 < prefs->numPlaces)
+					setPlace(&prefs->places[i + 1],
+						 latitude, longitude);
+				else
+					addPlace(prefs, latitude, longitude);
+			}
+		}
+		value = WMGetUDStringForKey(prefs->defaults, "mode");
+		if (value)
+			prefs->mode = string_to_mode(value);
 		value = WMGetUDStringForKey(prefs->defaults, "icondir");
 		if (value) {
 			if (check_icondir(value))
@@ -792,15 +1833,23 @@ Preferences *setPreferences(int argc, char **argv)
 	/* set defaults */
 	prefs->units = GWEATHER_TEMP_UNIT_FAHRENHEIT;
 	/* default location is nyc */
-	prefs->latitude = 40.7128;
-	prefs->longitude = -74.0060;
+	prefs->numPlaces = 0;
+	prefs->places = NULL;
+	prefs->placesFromCommandLine = False;
+	addPlace(prefs, 40.7128, -74.0060);
 	prefs->interval = 60;
+	prefs->retry = 30;
 	prefs->background = DEFAULT_BG_COLOR;
 	prefs->text = DEFAULT_TEXT_COLOR;
 	prefs->icondir = DATADIR;
 	prefs->geoclue = True;
 	prefs->windowed = False;
 	prefs->days = 7;
+	prefs->mode = MODE_ICON;
+	prefs->dump = False;
+	prefs->recordDir = NULL;
+	prefs->replayDir = NULL;
+	prefs->statsFile = NULL;
 	prefs->defaults = WMGetStandardUserDefaults();
 	readPreferences(prefs);
 
@@ -813,19 +1862,26 @@ Preferences *setPreferences(int argc, char **argv)
 			{"help", no_argument, 0, 'h'},
 			{"units", required_argument, 0, 'u'},
 			{"interval", required_argument, 0, 'i'},
+			{"retry", required_argument, 0, 'r'},
 			{"background", required_argument, 0, 'b'},
 			{"text", required_argument, 0, 't'},
 			{"latitude", required_argument, 0, 'p'},
 			{"longitude", required_argument, 0, 'l'},
+			{"location", required_argument, 0, 'L'},
 			{"icondir", required_argument, 0, 'I'},
 			{"no-geoclue", no_argument, 0, 'n'},
 			{"windowed", no_argument, 0, 'w'},
 			{"days", required_argument, 0, 'd'},
+			{"mode", required_argument, 0, 'm'},
+			{"dump", no_argument, 0, 'D'},
+			{"record", required_argument, 0, 'R'},
+			{"replay", required_argument, 0, 'P'},
+			{"stats-file", required_argument, 0, 'S'},
 			{0, 0, 0, 0}
 		};
 		int option_index = 0;
 
-		c = getopt_long(argc, argv, "vhu:i:b:t:p:l:I:nwd:",
+		c = getopt_long(argc, argv, "vhu:i:r:b:t:p:l:L:I:nwd:m:DR:P:S:",
 				 long_options, &option_index);
 
 		if (c == -1)
@@ -859,7 +1915,11 @@ Preferences *setPreferences(int argc, char **argv)
 			break;
 
 		case 'i':
-			prefs->interval = strtol(optarg, NULL, 10);
+			prefs->interval = parseInterval(optarg);
+			break;
+
+		case 'r':
+			prefs->retry = strtol(optarg, NULL, 10);
 			break;
 
 		case 'b':
@@ -871,12 +1931,31 @@ Preferences *setPreferences(int argc, char **argv)
 			break;
 
 		case 'p':
-			prefs->latitude = atof(optarg);
+			setPlace(&prefs->places[0], atof(optarg),
+				 prefs->places[0].longitude);
 			break;
 
 		case 'l':
-			prefs->longitude = atof(optarg);
+			setPlace(&prefs->places[0], prefs->places[0].latitude,
+				 atof(optarg));
+			break;
+
+		case 'L': {
+			double latitude, longitude;
+
+			if (!parsePlace(optarg, &latitude, &longitude)) {
+				printf("location must be 'latitude,longitude'\n");
+				exit(0);
+			}
+			/* locations on the command line replace the ones in
+			 * the defaults file */
+			if (!prefs->placesFromCommandLine) {
+				truncatePlaces(prefs, 1);
+				prefs->placesFromCommandLine = True;
+			}
+			addPlace(prefs, latitude, longitude);
 			break;
+		}
 
 		case 'I':
 			if (check_icondir(optarg))
@@ -897,6 +1976,31 @@ Preferences *setPreferences(int argc, char **argv)
 			prefs->days = atoi(optarg);
 			break;
 
+		case 'm':
+			if ((strcmp(optarg, "icon") != 0) &&
+			    (strcmp(optarg, "graph") != 0)) {
+				printf("mode must be 'icon' or 'graph'\n");
+				exit(0);
+			}
+			prefs->mode = string_to_mode(optarg);
+			break;
+
+		case 'D':
+			prefs->dump = True;
+			break;
+
+		case 'R':
+			prefs->recordDir = optarg;
+			break;
+
+		case 'P':
+			prefs->replayDir = optarg;
+			break;
+
+		case 'S':
+			prefs->statsFile = optarg;
+			break;
+
 		case '?':
 		case 'h':
 			printf("A weather dockapp for Window Maker using libgweather\n"
@@ -905,16 +2009,29 @@ Preferences *setPreferences(int argc, char **argv)
 			       "    -v, --version            print the version number\n"
 			       "    -h, --help               print this help screen\n"
 			       "    -i, --interval <min>     number of minutes between refreshes (default 60)\n"
+			       "    -r, --retry <min>        maximum minutes between retries after an error\n"
+			       "                             (default 30)\n"
 			       "    -u, --units <c|f>        whether to use Celsius or Fahrenheit (default f)\n"
 			       "    -b, --background <color> set background color\n"
 			       "    -t, --text <color>       set text color\n"
 			       "    -p, --latitude <coord>   set latitude\n"
 			       "    -l, --longitude <coord>  set longitude\n"
+			       "    -L, --location <lat,lon> add another tile for this location\n"
+			       "                             (may be given more than once)\n"
 			       "    -I, --icondir <dir>      set icon directory\n"
 			       "                             (default "DATADIR")\n"
 			       "    -n, --no-geoclue         disable geoclue\n"
 			       "    -w, --windowed           run in windowed mode\n"
 			       "    -d, --days               number of days to show in forecast (default 7)\n"
+			       "    -m, --mode <icon|graph>  show just the icon, or the icon and a graph of\n"
+			       "                             the next 36 hours (default icon)\n"
+			       "    -D, --dump               print the weather for every location as json\n"
+			       "                             and exit, without connecting to X\n"
+			       "    -R, --record <dir>       save every weather update in dir\n"
+			       "    -P, --replay <dir>       read weather updates saved with --record\n"
+			       "                             from dir instead of the network\n"
+			       "    -S, --stats-file <file>  append refresh timings to file on SIGUSR1\n"
+			       "                             (default stderr)\n"
 			       "Report bugs to: %s\n"
 			       "wmforecast home page: %s\n",
 			       PACKAGE_BUGREPORT, PACKAGE_URL
@@ -938,10 +2055,74 @@ static void closePreferences(WMWidget *widget, void *data)
 	d->prefsWindowPresent = 0;
 }
 
+/* write the "locations" default with this tile's coordinates taken from
+ * the preferences window */
+static void saveLocations(Dockapp *d)
+{
+	WMPropList *locations;
+	int i;
+
+	locations = WMCreatePLArray(NULL);
+	for (i = 1; i < d->prefs->numPlaces; i++) {
+		char location[64];
+
+		if (i == d->place)
+			snprintf(location, sizeof(location), "%s,%s",
+				 WMGetTextFieldText(d->prefsWindow->latitude),
+				 WMGetTextFieldText(d->prefsWindow->longitude));
+		else
+			snprintf(location, sizeof(location), "%.4f,%.4f",
+				 d->prefs->places[i].latitude,
+				 d->prefs->places[i].longitude);
+		WMAddToPLArray(locations, WMCreatePLString(location));
+	}
+
+	WMSetUDObjectForKey(d->prefs->defaults, locations, "locations");
+	WMReleasePropList(locations);
+}
+
+/* the strings in prefs belong to the user defaults, which writing the
+ * new values may release, so the old ones are compared by name */
+static int getPreferenceChanges(Preferences *prefs, long int interval,
+				GWeatherTemperatureUnit units,
+				const char *background, const char *text,
+				const char *icondir)
+{
+	int changes = 0;
+
+	if (prefs->interval != interval)
+		changes |= CHANGED_INTERVAL;
+	if (strcmp(prefs->background, background) != 0 ||
+	    strcmp(prefs->text, text) != 0)
+		changes |= CHANGED_COLORS;
+	if (prefs->units != units)
+		changes |= CHANGED_UNITS;
+	if (strcmp(prefs->icondir, icondir) != 0)
+		changes |= CHANGED_ICONDIR;
+
+	return changes;
+}
+
 static void savePreferences(WMWidget *widget, void *data)
 {
 	Dockapp *d = (Dockapp *)data;
+	Place *places;
+	long int interval;
+	GWeatherTemperatureUnit units;
+	char *background, *text, *icondir;
+	int i, numPlaces, changes;
+
 	(void)widget;
+	/* any tile's location can be edited from its own window */
+	numPlaces = d->prefs->numPlaces;
+	places = wmalloc(numPlaces * sizeof(Place));
+	memcpy(places, d->prefs->places, numPlaces * sizeof(Place));
+	interval = d->prefs->interval;
+	units = d->prefs->units;
+	background = wstrdup(d->prefs->background);
+	text = wstrdup(d->prefs->text);
+	icondir = wstrdup(d->prefs->icondir);
+
 	if (WMGetButtonSelected(d->prefsWindow->celsius))
 		WMSetUDStringForKey(d->prefs->defaults, "c", "units");
 	if (WMGetButtonSelected(d->prefsWindow->fahrenheit))
@@ -959,12 +2140,26 @@ static void savePreferences(WMWidget *widget, void *data)
 				    WMGetColorWellColor(
 					    d->prefsWindow->text)),
 			    "text");
-	WMSetUDStringForKey(d->prefs->defaults,
-			    WMGetTextFieldText(d->prefsWindow->latitude),
-			    "latitude");
-	WMSetUDStringForKey(d->prefs->defaults,
-			    WMGetTextFieldText(d->prefsWindow->longitude),
-			    "longitude");
+	if (d->place == 0) {
+		WMSetUDStringForKey(d->prefs->defaults,
+				    WMGetTextFieldText(d->prefsWindow->latitude),
+				    "latitude");
+		WMSetUDStringForKey(d->prefs->defaults,
+				    WMGetTextFieldText(d->prefsWindow->longitude),
+				    "longitude");
+	}
+	/* keep the other tiles where they are when the defaults are read
+	 * back in.  tiles from -L only last as long as the process, like
+	 * the rest of the command line, so they are moved in place. */
+	if (d->prefs->placesFromCommandLine) {
+		if (d->place > 0)
+			setPlace(getPlace(d),
+				 atof(WMGetTextFieldText(
+					      d->prefsWindow->latitude)),
+				 atof(WMGetTextFieldText(
+					      d->prefsWindow->longitude)));
+	} else if (d->prefs->numPlaces > 1)
+		saveLocations(d);
 	if (check_icondir(d->prefsWindow->icondir))
 		WMSetUDStringForKey(d->prefs->defaults, d->prefsWindow->icondir,
 				"icondir");
@@ -974,8 +2169,41 @@ static void savePreferences(WMWidget *widget, void *data)
 	WMSaveUserDefaults(d->prefs->defaults);
 
 	readPreferences(d->prefs);
-	updateDockapp(d);
+	changes = getPreferenceChanges(d->prefs, interval, units, background,
+				       text, icondir);
+	wfree(background);
+	wfree(text);
+	wfree(icondir);
+
+	if (changes & CHANGED_COLORS)
+		setPalette(d->palette, d->screen, d->prefs);
+
+	/* everything but the location is shared by all of the tiles.
+	 * temperatures are kept in CANONICAL_UNITS, so only a new location
+	 * needs a fetch */
+	for (i = 0; i < d->list->length; i++) {
+		Dockapp *dockapp = d->list->dockapps[i];
+		Place *place = getPlace(dockapp);
+
+		if (changes & CHANGED_COLORS)
+			applyPalette(dockapp);
+
+		if (dockapp->place >= numPlaces ||
+		    place->latitude != places[dockapp->place].latitude ||
+		    place->longitude != places[dockapp->place].longitude) {
+			scheduleDockapp(dockapp, getRefreshSeconds(d->prefs));
+			updateDockapp(dockapp);
+			continue;
+		}
 
+		if (changes & CHANGED_INTERVAL)
+			scheduleDockapp(dockapp, getRefreshSeconds(d->prefs));
+		if (changes & (CHANGED_COLORS | CHANGED_UNITS |
+			       CHANGED_ICONDIR))
+			redrawWeather(dockapp);
+	}
+
+	wfree(places);
 }
 
 #ifdef HAVE_GEOCLUE
@@ -1028,21 +2256,23 @@ static void findCoords(WMWidget *widget, void *data)
 
 	gclue_simple_new("wmforecast", GCLUE_ACCURACY_LEVEL_CITY, NULL,
 			 foundCoords, d);
+	g_main_context_wakeup(NULL);
 }
 #endif
 
 void restore_default_colors(WMWidget *widget, void *data)
 {
 	Dockapp *d = (Dockapp *)data;
+	WMColor *color;
 
 	(void)widget;
 
-	WMSetColorWellColor(d->prefsWindow->background,
-			    WMCreateNamedColor(d->screen, DEFAULT_BG_COLOR,
-					       True));
-	WMSetColorWellColor(d->prefsWindow->text,
-			    WMCreateNamedColor(d->screen, DEFAULT_TEXT_COLOR,
-					       True));
+	color = WMCreateNamedColor(d->screen, DEFAULT_BG_COLOR, True);
+	WMSetColorWellColor(d->prefsWindow->background, color);
+	WMReleaseColor(color);
+	color = WMCreateNamedColor(d->screen, DEFAULT_TEXT_COLOR, True);
+	WMSetColorWellColor(d->prefsWindow->text, color);
+	WMReleaseColor(color);
 }
 
 static void icon_chooser(WMWidget *widget, void *data)
@@ -1130,7 +2360,7 @@ static void editPreferences(void *data)
 
 	d->prefsWindow->latitude = WMCreateTextField(
 		d->prefsWindow->locationFrame);
-	sprintf(intervalPtr, "%.4f", d->prefsWindow->prefs->latitude);
+	sprintf(intervalPtr, "%.4f", getPlace(d)->latitude);
 	WMSetTextFieldText(d->prefsWindow->latitude, intervalPtr);
 	WMResizeWidget(d->prefsWindow->latitude, 65, 18);
 	WMMoveWidget(d->prefsWindow->latitude, 80, 17);
@@ -1147,7 +2377,7 @@ static void editPreferences(void *data)
 
 	d->prefsWindow->longitude = WMCreateTextField(
 		d->prefsWindow->locationFrame);
-	sprintf(intervalPtr, "%.4f", d->prefsWindow->prefs->longitude);
+	sprintf(intervalPtr, "%.4f", getPlace(d)->longitude);
 	WMSetTextFieldText(d->prefsWindow->longitude, intervalPtr);
 	WMResizeWidget(d->prefsWindow->longitude, 65, 18);
 	WMMoveWidget(d->prefsWindow->longitude, 80, 36);
@@ -1207,7 +2437,7 @@ static void editPreferences(void *data)
 	WMMapWidget(d->prefsWindow->backgroundLabel);
 
 	d->prefsWindow->background = WMCreateColorWell(d->prefsWindow->colors);
-	WMSetColorWellColor(d->prefsWindow->background, WMCreateNamedColor(d->screen, d->prefs->background, True));
+	WMSetColorWellColor(d->prefsWindow->background, d->palette->background);
 	WMMoveWidget(d->prefsWindow->background, 88, 16);
 	WMRealizeWidget(d->prefsWindow->background);
 	WMMapWidget(d->prefsWindow->background);
@@ -1221,7 +2451,7 @@ static void editPreferences(void *data)
 	WMMapWidget(d->prefsWindow->textLabel);
 
 	d->prefsWindow->text = WMCreateColorWell(d->prefsWindow->colors);
-	WMSetColorWellColor(d->prefsWindow->text, WMCreateNamedColor(d->screen, d->prefs->text, True));
+	WMSetColorWellColor(d->prefsWindow->text, d->palette->text);
 	WMMoveWidget(d->prefsWindow->text, 190, 16);
 	WMRealizeWidget(d->prefsWindow->text);
 	WMMapWidget(d->prefsWindow->text);
@@ -1285,14 +2515,19 @@ static void refresh(XEvent *event, void *data)
 	switch (event->xbutton.button) {
 	case Button1:
 		if (WMIsDoubleClick(event)) {
-			d->minutesLeft = d->prefs->interval;
+			/* show that the click did something */
+			showLoading(d);
+			scheduleDockapp(d, getRefreshSeconds(d->prefs));
 			updateDockapp(d);
 		}
 		break;
 
 	case Button2:
 		d->showForecast = 1 - d->showForecast;
-		updateDockapp(d);
+		if (d->weather)
+			showBalloon(d);
+		else
+			updateDockapp(d);
 		break;
 
 	case Button3:
@@ -1305,35 +2540,442 @@ static void refresh(XEvent *event, void *data)
 	}
 }
 
+/* microseconds on the scheduler's clock, which keeps running while the
+ * machine is suspended where possible, so a deadline that passed during
+ * suspend is noticed on resume */
+static long long schedulerNow(RefreshScheduler *scheduler)
+{
+	struct timespec now;
+
+	clock_gettime(scheduler->clock, &now);
+	return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void rearmDockappList(DockappList *list)
+{
+	long long deadline;
+	int i;
+
+	if (list->length == 0)
+		return;
+
+	deadline = list->dockapps[0]->due;
+	for (i = 1; i < list->length; i++)
+		if (list->dockapps[i]->due < deadline)
+			deadline = list->dockapps[i]->due;
+
+	scheduleRefreshAt(list->scheduler, deadline);
+}
+
+/* refresh every tile that is due, along with any that would be due
+ * shortly after, so that their fetches happen together */
 static void timerHandler(void *data)
 {
-	Dockapp *d = (Dockapp *)data;
+	DockappList *list = (DockappList *)data;
+	long long now;
+	int i;
+
+	now = schedulerNow(list->scheduler);
+	for (i = 0; i < list->length; i++) {
+		Dockapp *d = list->dockapps[i];
 
-	d->minutesLeft--;
-	if (d->minutesLeft == 0) {
-		d->minutesLeft = d->prefs->interval;
-		updateDockapp(data);
+		if (d->due > now + REFRESH_BATCH_WINDOW * 1000000LL)
+			continue;
+		d->due = now + getRefreshSeconds(d->prefs) * 1000000LL;
+		updateDockapp(d);
 	}
+
+	rearmDockappList(list);
 }
 
-void do_glib_loop(void *data)
+static void armRefreshScheduler(RefreshScheduler *scheduler);
+
+static void refreshSchedulerHandler(RefreshScheduler *scheduler)
 {
-	(void)data;
-	g_main_context_iteration(NULL, 0);
+	if (schedulerNow(scheduler) < scheduler->deadline) {
+		/* WINGs timers don't use our clock, so they may fire early */
+		armRefreshScheduler(scheduler);
+		return;
+	}
+
+	scheduler->deadline = 0;
+	scheduler->callback(scheduler->data);
+}
+
+static void refreshSchedulerTimer(void *data)
+{
+	RefreshScheduler *scheduler = (RefreshScheduler *)data;
+
+	/* one-shot timers are freed by WINGs once they fire */
+	scheduler->timer = NULL;
+	refreshSchedulerHandler(scheduler);
+}
+
+#ifdef HAVE_SYS_TIMERFD_H
+static void refreshSchedulerInput(int fd, int mask, void *data)
+{
+	guint64 expirations;
+
+	(void)mask;
+	if (read(fd, &expirations, sizeof(expirations)) < 0)
+		return;
+	refreshSchedulerHandler((RefreshScheduler *)data);
+}
+#endif
+
+static void armRefreshScheduler(RefreshScheduler *scheduler)
+{
+	long long remaining;
+
+	if (scheduler->timer) {
+		WMDeleteTimerHandler(scheduler->timer);
+		scheduler->timer = NULL;
+	}
+
+#ifdef HAVE_SYS_TIMERFD_H
+	if (scheduler->fd >= 0) {
+		struct itimerspec spec;
+
+		memset(&spec, 0, sizeof(spec));
+		spec.it_value.tv_sec = scheduler->deadline / 1000000;
+		spec.it_value.tv_nsec = scheduler->deadline % 1000000 * 1000;
+		if (timerfd_settime(scheduler->fd, TFD_TIMER_ABSTIME,
+				    &spec, NULL) == 0)
+			return;
+		wwarning("could not arm refresh timer; falling back to "
+			 "WINGs timers");
+		WMDeleteInputHandler(scheduler->input);
+		close(scheduler->fd);
+		scheduler->fd = -1;
+	}
+#endif
+
+	remaining = (scheduler->deadline - schedulerNow(scheduler)) / 1000;
+	if (remaining < 0)
+		remaining = 0;
+	if (remaining > INT_MAX)
+		remaining = INT_MAX;
+	scheduler->timer = WMAddTimerHandler(remaining, refreshSchedulerTimer,
+					     scheduler);
+}
+
+RefreshScheduler *newRefreshScheduler(WMCallback *callback, void *data)
+{
+	RefreshScheduler *scheduler = wmalloc(sizeof(RefreshScheduler));
+
+	scheduler->deadline = 0;
+	scheduler->clock = CLOCK_MONOTONIC;
+#ifdef CLOCK_BOOTTIME
+	if (clock_getres(CLOCK_BOOTTIME, NULL) == 0)
+		scheduler->clock = CLOCK_BOOTTIME;
+#endif
+	scheduler->callback = callback;
+	scheduler->data = data;
+	scheduler->timer = NULL;
+	scheduler->fd = -1;
+	scheduler->input = NULL;
+
+#ifdef HAVE_SYS_TIMERFD_H
+	scheduler->fd = timerfd_create(scheduler->clock,
+				       TFD_NONBLOCK | TFD_CLOEXEC);
+	/* absolute deadlines have to be read from the timerfd's clock */
+	if (scheduler->fd < 0 && scheduler->clock != CLOCK_MONOTONIC) {
+		scheduler->clock = CLOCK_MONOTONIC;
+		scheduler->fd = timerfd_create(scheduler->clock,
+					       TFD_NONBLOCK | TFD_CLOEXEC);
+	}
+	if (scheduler->fd >= 0)
+		scheduler->input = WMAddInputHandler(
+			scheduler->fd, WIReadMask, refreshSchedulerInput,
+			scheduler);
+#endif
+
+	return scheduler;
+}
+
+/* replace the next refresh deadline with the given absolute one, in
+ * microseconds on the scheduler's clock */
+void scheduleRefreshAt(RefreshScheduler *scheduler, long long deadline)
+{
+	scheduler->deadline = deadline;
+	armRefreshScheduler(scheduler);
+}
+
+DockappList *newDockappList(WMScreen *screen)
+{
+	DockappList *list = wmalloc(sizeof(DockappList));
+
+	(void)screen;
+	list->length = 0;
+	list->dockapps = NULL;
+	list->scheduler = newRefreshScheduler(timerHandler, list);
+	list->palette = newPalette();
+	list->icons = newIconCache();
+	return list;
+}
+
+/* replace the tile's next refresh with one the given number of seconds
+ * from now */
+void scheduleDockapp(Dockapp *dockapp, long int seconds)
+{
+	if (seconds < 1)
+		seconds = 1;
+	dockapp->due = schedulerNow(dockapp->list->scheduler) +
+		seconds * 1000000LL;
+	rearmDockappList(dockapp->list);
+}
+
+RetryPolicy *newRetryPolicy(void)
+{
+	RetryPolicy *policy = wmalloc(sizeof(RetryPolicy));
+	resetRetryPolicy(policy);
+	return policy;
+}
+
+/* double the delay after each consecutive failure, up to ceiling seconds,
+ * and pick a random point in its upper half so that dockapps which failed
+ * together don't retry together */
+long int nextRetryDelay(RetryPolicy *policy, long int ceiling)
+{
+	long int delay;
+	int i;
+
+	if (ceiling < RETRY_BASE)
+		ceiling = RETRY_BASE;
+
+	delay = RETRY_BASE;
+	for (i = 0; i < policy->failures && delay < ceiling; i++)
+		delay *= 2;
+	if (delay > ceiling)
+		delay = ceiling;
+
+	delay = delay / 2 + g_random_int_range(0, delay / 2 + 1);
+
+	policy->failures++;
+	policy->delay = delay;
+	return delay;
+}
+
+void resetRetryPolicy(RetryPolicy *policy)
+{
+	policy->failures = 0;
+	policy->delay = 0;
+}
+
+static void watchGlibLoop(GlibLoop *loop);
+
+static void dispatchGlibLoop(GlibLoop *loop)
+{
+	g_main_context_acquire(loop->context);
+	if (g_main_context_check(loop->context, loop->maxPriority,
+				 loop->fds, loop->nfds))
+		g_main_context_dispatch(loop->context);
+	g_main_context_release(loop->context);
+
+	watchGlibLoop(loop);
+}
+
+static void glibInputHandler(int fd, int mask, void *data)
+{
+	GlibLoop *loop = (GlibLoop *)data;
+	int i;
+
+	for (i = 0; i < loop->nfds; i++) {
+		if (loop->fds[i].fd != fd)
+			continue;
+		if (mask & WIReadMask)
+			loop->fds[i].revents |= loop->fds[i].events &
+				(G_IO_IN | G_IO_HUP | G_IO_ERR);
+		if (mask & WIWriteMask)
+			loop->fds[i].revents |= loop->fds[i].events & G_IO_OUT;
+		if (mask & WIExceptMask)
+			loop->fds[i].revents |= loop->fds[i].events & G_IO_PRI;
+	}
+
+	dispatchGlibLoop(loop);
+}
+
+static void glibTimerHandler(void *data)
+{
+	GlibLoop *loop = (GlibLoop *)data;
+
+	/* one-shot timers are freed by WINGs once they fire */
+	loop->timer = NULL;
+	dispatchGlibLoop(loop);
+}
+
+static int glibConditionToMask(gushort events)
+{
+	int mask = 0;
+
+	if (events & (G_IO_IN | G_IO_HUP | G_IO_ERR))
+		mask |= WIReadMask;
+	if (events & G_IO_OUT)
+		mask |= WIWriteMask;
+	if (events & G_IO_PRI)
+		mask |= WIExceptMask;
+
+	return mask;
+}
+
+/* ask the context which file descriptors and timeout it is waiting on and
+ * hand them to the WINGs event loop, so that we only wake up when glib
+ * actually has something to do */
+static void watchGlibLoop(GlibLoop *loop)
+{
+	int i, nfds, oldnfds, timeout;
+
+	oldnfds = loop->nfds;
+	memcpy(loop->oldfds, loop->fds, oldnfds * sizeof(GPollFD));
+
+	g_main_context_acquire(loop->context);
+	g_main_context_prepare(loop->context, &loop->maxPriority);
+	while ((nfds = g_main_context_query(
+			loop->context, loop->maxPriority, &timeout,
+			loop->fds, loop->allocated)) > loop->allocated) {
+		loop->fds = wrealloc(loop->fds, nfds * sizeof(GPollFD));
+		loop->oldfds = wrealloc(loop->oldfds, nfds * sizeof(GPollFD));
+		loop->handlers = wrealloc(loop->handlers,
+					  nfds * sizeof(WMHandlerID));
+		for (i = loop->allocated; i < nfds; i++)
+			loop->handlers[i] = NULL;
+		loop->allocated = nfds;
+	}
+	g_main_context_release(loop->context);
+	loop->nfds = nfds;
+
+	/* only replace the input handlers whose descriptors changed */
+	for (i = 0; i < nfds || i < oldnfds; i++) {
+		if (i < nfds)
+			loop->fds[i].revents = 0;
+		if (i < nfds && i < oldnfds && loop->handlers[i] &&
+		    loop->fds[i].fd == loop->oldfds[i].fd &&
+		    loop->fds[i].events == loop->oldfds[i].events)
+			continue;
+		if (loop->handlers[i]) {
+			WMDeleteInputHandler(loop->handlers[i]);
+			loop->handlers[i] = NULL;
+		}
+		if (i < nfds)
+			loop->handlers[i] = WMAddInputHandler(
+				loop->fds[i].fd,
+				glibConditionToMask(loop->fds[i].events),
+				glibInputHandler, loop);
+	}
+
+	if (loop->timer) {
+		WMDeleteTimerHandler(loop->timer);
+		loop->timer = NULL;
+	}
+	if (timeout >= 0)
+		loop->timer = WMAddTimerHandler(timeout, glibTimerHandler, loop);
+}
+
+GlibLoop *newGlibLoop(void)
+{
+	GlibLoop *loop = wmalloc(sizeof(GlibLoop));
+	int i;
+
+	loop->context = g_main_context_default();
+	/* own the context for the life of the process: an unowned context
+	 * isn't woken up when another thread (e.g., the threaded resolver
+	 * behind libsoup) attaches a source to it, so the dispatch would wait
+	 * for some unrelated event.  the acquire/release pairs around
+	 * dispatching and querying are then just nested. */
+	if (!g_main_context_acquire(loop->context))
+		wwarning("could not acquire the glib main context");
+	loop->maxPriority = G_PRIORITY_DEFAULT;
+	loop->nfds = 0;
+	loop->allocated = 8;
+	loop->fds = wmalloc(loop->allocated * sizeof(GPollFD));
+	loop->oldfds = wmalloc(loop->allocated * sizeof(GPollFD));
+	loop->handlers = wmalloc(loop->allocated * sizeof(WMHandlerID));
+	for (i = 0; i < loop->allocated; i++)
+		loop->handlers[i] = NULL;
+	loop->timer = NULL;
+
+	watchGlibLoop(loop);
+	return loop;
+}
+
+
+/* the signal handler only writes to this pipe, and the stats are printed
+ * from the event loop */
+static int statsPipe[2] = {-1, -1};
+
+static void statsSignalHandler(int signum)
+{
+	int saved = errno;
+
+	(void)signum;
+	if (write(statsPipe[1], "", 1) < 0) {
+		/* the pipe is full, so a dump is already pending */
+	}
+	errno = saved;
+}
+
+static void statsInputHandler(int fd, int mask, void *data)
+{
+	Preferences *prefs = (Preferences *)data;
+	char buffer[16];
+	FILE *stream;
+
+	(void)mask;
+	while (read(fd, buffer, sizeof(buffer)) > 0)
+		;
+
+	stream = stderr;
+	if (prefs->statsFile) {
+		stream = fopen(prefs->statsFile, "a");
+		if (!stream) {
+			wwarning("could not open %s", prefs->statsFile);
+			return;
+		}
+	}
+
+	printRefreshStats(stream);
+
+	if (stream != stderr)
+		fclose(stream);
 }
 
+void watchStatsSignal(Preferences *prefs)
+{
+	struct sigaction action;
+	int i;
+
+	if (pipe(statsPipe) != 0) {
+		wwarning("could not create pipe; SIGUSR1 will be ignored");
+		return;
+	}
+	for (i = 0; i < 2; i++)
+		fcntl(statsPipe[i], F_SETFL,
+		      fcntl(statsPipe[i], F_GETFL) | O_NONBLOCK);
+
+	WMAddInputHandler(statsPipe[0], WIReadMask, statsInputHandler, prefs);
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = statsSignalHandler;
+	sigemptyset(&action.sa_mask);
+	action.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &action, NULL);
+}
 
 int main(int argc, char **argv)
 {
 	Display *display;
-	Dockapp *dockapp;
+	DockappList *list;
 	Preferences *prefs;
 	WMScreen *screen;
+	int i;
 
 	WMInitializeApplication("wmforecast", &argc, argv);
 
 	prefs = setPreferences(argc, argv);
 
+	if (prefs->dump)
+		return dumpWeather(prefs);
+
 	display = XOpenDisplay("");
 
 	if (!display) {
@@ -1342,16 +2984,21 @@ int main(int argc, char **argv)
 	}
 
 	screen = WMCreateScreen(display, DefaultScreen(display));
-	dockapp = newDockapp(screen, prefs, argc, argv);
+	list = newDockappList(screen);
 
-	WMCreateEventHandler(WMWidgetView(dockapp->icon), ButtonPressMask,
-			     refresh, dockapp);
+	for (i = 0; i < prefs->numPlaces; i++) {
+		Dockapp *dockapp;
+
+		dockapp = newDockapp(list, screen, prefs, i, argc, argv);
+		WMCreateEventHandler(WMWidgetView(dockapp->icon),
+				     ButtonPressMask, refresh, dockapp);
+	}
 
-	updateDockapp(dockapp);
-	WMAddPersistentTimerHandler(60*1000, /* one minute */
-				    timerHandler, dockapp);
+	for (i = 0; i < list->length; i++)
+		startDockapp(list->dockapps[i]);
 
-	WMAddPersistentTimerHandler(100, do_glib_loop, NULL);
+	newGlibLoop();
+	watchStatsSignal(prefs);
 
 	WMScreenMainLoop(screen);
 
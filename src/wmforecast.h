@@ -0,0 +1,230 @@
+/* Copyright (C) 2014-2023 Doug Torrance <dtorrance@piedmont.edu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* the parts of wmforecast that don't need a display, shared by the dockapp
+ * and the benchmarks */
+
+#ifndef WMFORECAST_H
+#define WMFORECAST_H
+
+#define GWEATHER_I_KNOW_THIS_IS_UNSTABLE
+#include <libgweather/gweather.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+#include <WINGs/WUtil.h>
+
+#define ARENA_CHUNK_SIZE 4096
+#define ARENA_ALIGNMENT sizeof(double)
+#define NUM_ICONS 10
+#define RECORDING_VERSION 1
+#define STATS_WINDOW 256
+#define ATTRIBUTION_CACHE_SIZE 4
+#define SECONDS_PER_DAY 86400
+#define HOURLY_CAPACITY 240 /* ten days */
+#define MAX_FORECASTS 16 /* days */
+
+/* temperatures are kept in this unit and converted when they are shown */
+#define CANONICAL_UNITS GWEATHER_TEMP_UNIT_CENTIGRADE
+
+typedef struct ArenaChunk {
+	struct ArenaChunk *next;
+	size_t size;
+	size_t used;
+	char data[];
+} ArenaChunk;
+
+/* bump allocator for everything built during a single refresh, released
+ * all at once when the next refresh replaces it */
+typedef struct {
+	ArenaChunk *chunks;
+	ArenaChunk *current;
+} Arena;
+
+typedef struct {
+	float low;
+	float high;
+	const char *text; /* interned */
+	unsigned char weekday; /* 0 is sunday, as in struct tm */
+} Forecast;
+
+/* stored inline, so a whole forecast is one block of the Weather */
+typedef struct {
+	int length;
+	Forecast forecasts[MAX_FORECASTS];
+} ForecastArray;
+
+/* a growable string, so building a long balloon text stays linear */
+typedef struct {
+	char *text;
+	size_t length;
+	size_t capacity;
+} TextBuilder;
+
+/* the current conditions or one hourly entry of a forecast list, as read
+ * from a GWeatherInfo */
+typedef struct {
+	time_t time; /* 0 if unknown */
+	Bool haveTemp;
+	double temp;
+	const char *conditions;
+	const char *summary;
+	const char *code;
+} ForecastSample;
+
+/* everything wmforecast uses from one provider update, so that it can be
+ * recorded to disk and fed back in later without going to the network */
+typedef struct {
+	Bool valid;
+	GWeatherTemperatureUnit units;
+	const char *attribution;
+	ForecastSample current;
+	/* detailed conditions of the first entry with a temperature */
+	const char *details;
+	int length;
+	ForecastSample *samples;
+} ProviderResult;
+
+/* the parts of a refresh that are timed */
+typedef enum {
+	PHASE_LOCATION,
+	PHASE_PROVIDER,
+	PHASE_READ,
+	PHASE_BUILD,
+	PHASE_ICON,
+	PHASE_DRAW,
+	PHASE_TOTAL,
+	NUM_PHASES
+} Phase;
+
+/* the last STATS_WINDOW durations of one phase, in microseconds */
+typedef struct {
+	int length;
+	int next;
+	long long samples[STATS_WINDOW];
+} PhaseTimes;
+
+typedef struct {
+	PhaseTimes phases[NUM_PHASES];
+	unsigned long refreshes;
+	unsigned long errors;
+	unsigned long retries;
+	unsigned long long balloonBytes;
+} RefreshStats;
+
+/* one local day's worth of forecast samples */
+typedef struct {
+	int samples;
+	double high;
+	double low;
+	const char *conditions;
+} DayBucket;
+
+/* the icons every theme has, in the order of icon_names; every icon name
+ * libgweather uses maps to one of these */
+typedef enum {
+	ICON_ERROR,
+	ICON_CLEAR_NIGHT,
+	ICON_CLEAR,
+	ICON_FEW_CLOUDS_NIGHT,
+	ICON_FEW_CLOUDS,
+	ICON_FOG,
+	ICON_OVERCAST,
+	ICON_SHOWERS,
+	ICON_SNOW,
+	ICON_STORM
+} IconSlot;
+
+/* hourly forecast entries, oldest first, one array per field */
+typedef struct {
+	int capacity;
+	int length;
+	time_t *times;
+	float *temps; /* CANONICAL_UNITS */
+	unsigned char *icons; /* IconSlot */
+} HourlySeries;
+
+typedef struct Weather {
+	Arena *arena;
+	double temp; /* CANONICAL_UNITS, like the forecast */
+	const char *text; /* interned */
+	ForecastArray forecasts;
+	int errorFlag;
+	char *errorText;
+	const char *code; /* interned */
+	char *conditions;
+	char retrieved[20];
+	time_t timestamp;
+	const char *attribution;
+} Weather;
+
+extern const char *icon_names[NUM_ICONS];
+extern RefreshStats refreshStats;
+
+Arena *newArena(void);
+void *arenaAlloc(Arena *arena, size_t size);
+char *arenaStrdup(Arena *arena, const char *str);
+void resetArena(Arena *arena);
+void freeArena(Arena *arena);
+const char *internString(const char *text);
+const char *getWeekdayName(int weekday);
+Forecast *appendForecast(ForecastArray *array);
+Weather *newWeather(Arena *arena);
+void freeWeather(Weather *weather);
+void setError(Weather *weather, const char *errorText);
+void setConditions(Weather *weather, double temp, const char *text,
+		   const char *code);
+void setForecast(Forecast *forecast, int weekday, double low, double high,
+		 const char *text);
+int displayTemp(double temp, GWeatherTemperatureUnit units);
+char *getIconFilename(const char *icondir, const char *code);
+void initTextBuilder(TextBuilder *builder, size_t capacity);
+void reserveText(TextBuilder *builder, size_t length);
+void appendText(TextBuilder *builder, const char *text);
+void appendTextLength(TextBuilder *builder, const char *text, size_t length);
+void appendTextf(TextBuilder *builder, const char *format, ...);
+char *finishText(TextBuilder *builder);
+char *getForecastText(Weather *weather, int days,
+		      GWeatherTemperatureUnit units);
+char *getConditionsText(GWeatherInfo *info);
+IconSlot getIconSlot(const char *code);
+HourlySeries *newHourlySeries(int capacity);
+void clearHourlySeries(HourlySeries *series);
+void appendHourly(HourlySeries *series, time_t time, float temp,
+		  unsigned char icon);
+void getHourlyColumns(HourlySeries *series, time_t start, int seconds,
+		      int columns, float *values);
+void fillHourlySeries(HourlySeries *series, const ForecastSample *samples,
+		      int length, GWeatherTemperatureUnit units);
+long int getLocalOffset(time_t time);
+void gather_forecasts(Weather *weather, const ForecastSample *samples,
+		      int length, int days);
+char *strip_tags(const char *to_strip);
+Bool check_icondir(char *icondir);
+const char *getPLDictionaryString(WMPropList *dictionary, const char *key);
+double convertTemp(double temp, GWeatherTemperatureUnit from,
+		   GWeatherTemperatureUnit to);
+ProviderResult *readProviderResult(GWeatherInfo *info,
+				   GWeatherTemperatureUnit units,
+				   Arena *arena);
+const char *getAttributionText(const char *attribution);
+Weather *buildWeather(ProviderResult *result, int days, Arena *arena);
+long long statsNow(void);
+void recordPhase(Phase phase, long long started);
+void printRefreshStats(FILE *stream);
+Bool saveProviderResult(ProviderResult *result, const char *filename);
+ProviderResult *loadProviderResult(const char *filename, Arena *arena);
+
+#endif